@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUMBER_OF_COUNTERS 3
+#define CSV_HEADER "label,name,status,bytes,seconds,mb_per_second,cpu_seconds,max_rss_kb,context_switches,cycles,instructions,cache_misses\n"
+
+/***
+ * Hardware counters, of the command and everything it forks. Not every machine has
+ * them (VMs, containers, perf_event_paranoid) - a counter that can't be opened is
+ * left empty in the CSV.
+ */
+struct {
+	const char* name;
+	uint64_t config;
+} counters[NUMBER_OF_COUNTERS] = {
+	{ "cycles", PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache_misses", PERF_COUNT_HW_CACHE_MISSES },
+};
+
+pid_t child = 0;
+
+void forwardSignal(int signal) { // So a server can be stopped through its runner
+	if (child > 0) {
+		kill(child, signal);
+	}
+}
+
+int openCounter(pid_t pid, uint64_t config) {
+	struct perf_event_attr attributes;
+	memset(&attributes, 0, sizeof(attributes));
+	attributes.size = sizeof(attributes);
+	attributes.type = PERF_TYPE_HARDWARE;
+	attributes.config = config;
+	attributes.disabled = 1;
+	attributes.enable_on_exec = 1; // Not the runner's fork, just the command
+	attributes.inherit = 1; // And its children - sym_mng's counters, say
+	attributes.exclude_kernel = 1; // Allowed at the default paranoia
+	attributes.exclude_hv = 1;
+	return (int) syscall(SYS_perf_event_open, &attributes, pid, -1, -1, 0);
+}
+
+double seconds() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+void printUsage() {
+	fprintf(stderr, "USAGE: ./bench_run [-o CSV_FILE] [-l LABEL] [-n NAME] [-b BYTES] -- <COMMAND> [ARGUMENT ...]\n");
+}
+
+/***
+ * Runs the command, waits for it, and appends a line to the CSV (stdout if none) -
+ * with a header if the file's new. Throughput is BYTES over the wall time - without
+ * -b, both columns are left empty (a server's wall time is how long it was up). The exit
+ * status is recorded rather than passed on - sym_count's is never 0 - but a command
+ * that couldn't be run, or was killed, fails the suite.
+ */
+int main(int argc, char* argv[]) {
+	const char* csvFileName = NULL;
+	const char* label = "";
+	const char* name = NULL;
+	long long bytes = 0; // 0 for no throughput
+	int option;
+	while ((option = getopt(argc, argv, "+o:l:n:b:")) != -1) {
+		switch (option) {
+			case 'o':
+				csvFileName = optarg;
+				break;
+			case 'l':
+				label = optarg;
+				break;
+			case 'n':
+				name = optarg;
+				break;
+			case 'b':
+				bytes = atoll(optarg);
+				break;
+			default:
+				printUsage();
+				return 1;
+		}
+	}
+	if (optind >= argc) {
+		printUsage();
+		return 1;
+	}
+	char** command = argv + optind;
+	if (!name) {
+		name = command[0];
+	}
+
+	// The child waits on the pipe until its counters are open, then execs
+	int ready[2];
+	if (pipe(ready)) {
+		perror("bench_run: Could not create pipe");
+		return 1;
+	}
+	child = fork();
+	if (child < 0) {
+		perror("bench_run: Could not fork");
+		return 1;
+	}
+	if (!child) {
+		char go;
+		close(ready[1]);
+		if (read(ready[0], &go, 1) != 1) {
+			_exit(127);
+		}
+		close(ready[0]);
+		execvp(command[0], command);
+		fprintf(stderr, "bench_run: Could not run %s: %s\n", command[0], strerror(errno));
+		_exit(127);
+	}
+
+	close(ready[0]);
+	signal(SIGINT, forwardSignal);
+	signal(SIGTERM, forwardSignal);
+	int counterDescriptors[NUMBER_OF_COUNTERS];
+	for (int i = 0; i < NUMBER_OF_COUNTERS; i++) {
+		counterDescriptors[i] = openCounter(child, counters[i].config);
+	}
+
+	double start = seconds();
+	if (write(ready[1], "", 1) != 1) {
+		perror("bench_run: Could not start command");
+		return 1;
+	}
+	close(ready[1]);
+
+	int status;
+	struct rusage usage;
+	while (wait4(child, &status, 0, &usage) < 0) {
+		if (errno != EINTR) {
+			perror("bench_run: Could not wait for command");
+			return 1;
+		}
+	}
+	double elapsed = seconds() - start;
+
+	FILE* stream = stdout;
+	if (csvFileName) {
+		struct stat st;
+		int fresh = stat(csvFileName, &st) || !st.st_size;
+		if (!(stream = fopen(csvFileName, "a"))) {
+			perror("bench_run: Could not open CSV file");
+			return 1;
+		}
+		if (fresh) {
+			fputs(CSV_HEADER, stream);
+		}
+	}
+	else {
+		fputs(CSV_HEADER, stream);
+	}
+
+	double cpuSeconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+	fprintf(stream, "%s,%s,%d,", label, name, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+	if (bytes) {
+		fprintf(stream, "%lld,%.6f,%.1f,", bytes, elapsed, bytes / 1048576.0 / elapsed);
+	}
+	else {
+		fprintf(stream, ",%.6f,,", elapsed);
+	}
+	fprintf(stream, "%.6f,%ld,%ld", cpuSeconds, usage.ru_maxrss, usage.ru_nvcsw + usage.ru_nivcsw);
+	for (int i = 0; i < NUMBER_OF_COUNTERS; i++) {
+		uint64_t value;
+		if (counterDescriptors[i] >= 0 && read(counterDescriptors[i], &value, sizeof(value)) == sizeof(value)) {
+			fprintf(stream, ",%llu", (unsigned long long) value);
+		}
+		else {
+			fputs(",", stream);
+		}
+	}
+	fputs("\n", stream);
+	if (stream != stdout) {
+		fclose(stream);
+	}
+
+	if (WIFSIGNALED(status)) {
+		fprintf(stderr, "bench_run: %s killed by signal %d\n", name, WTERMSIG(status));
+		return 1;
+	}
+	return WEXITSTATUS(status) == 127;
+}
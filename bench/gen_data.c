@@ -0,0 +1,142 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE (1024 * 1024) // Written, or left as a hole, at a time
+#define DEFAULT_SEED 88172645463325252ULL
+
+/***
+ * Same seed, same size, same everything else - same bytes, on any machine. Each chunk
+ * has its own generator, seeded from the seed and its index, so a chunk's contents
+ * don't depend on which of the chunks before it are holes.
+ */
+typedef struct generator_t {
+	uint64_t state;
+} Generator;
+
+uint64_t next(Generator* generator) { // xorshift64*
+	generator->state ^= generator->state >> 12;
+	generator->state ^= generator->state << 25;
+	generator->state ^= generator->state >> 27;
+	return generator->state * 0x2545F4914F6CDD1DULL;
+}
+
+void seed(Generator* generator, uint64_t seed, uint64_t chunk) { // splitmix64, so neighbouring chunks look nothing alike
+	uint64_t z = seed + (chunk + 1) * 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	generator->state = (z ^ (z >> 31)) | 1;
+}
+
+long long parseSize(const char* size) { // Bytes, or with a K/M/G suffix
+	char* end;
+	long long value = strtoll(size, &end, 10);
+	switch (toupper(*end)) {
+		case 'G':
+			value *= 1024;
+			/* fall through */
+		case 'M':
+			value *= 1024;
+			/* fall through */
+		case 'K':
+			value *= 1024;
+			end++;
+			break;
+	}
+
+	return *end || value < 0 ? -1 : value;
+}
+
+void printUsage() {
+	fprintf(stderr, "USAGE: ./gen_data [-s SEED] [-c SYMBOL] [-d DENSITY] [-H HOLE_FRACTION] <FILE> <SIZE>\n");
+}
+
+/***
+ * SYMBOL makes up DENSITY of the data, the rest is uniformly random bytes other than
+ * it - so the number of matches is known ahead. HOLE_FRACTION of the chunks are left
+ * as holes, for sparse inputs.
+ */
+int main(int argc, char* argv[]) {
+	uint64_t seedValue = DEFAULT_SEED;
+	unsigned char symbol = 'a';
+	double density = 0.01, holeFraction = 0;
+	int option;
+	while ((option = getopt(argc, argv, "s:c:d:H:")) != -1) {
+		switch (option) {
+			case 's':
+				seedValue = strtoull(optarg, NULL, 10);
+				break;
+			case 'c':
+				symbol = (unsigned char) optarg[0];
+				break;
+			case 'd':
+				density = atof(optarg);
+				break;
+			case 'H':
+				holeFraction = atof(optarg);
+				break;
+			default:
+				printUsage();
+				return 1;
+		}
+	}
+
+	long long size = argc - optind == 2 ? parseSize(argv[optind + 1]) : -1;
+	if (size < 0 || density < 0 || density > 1 || holeFraction < 0 || holeFraction > 1) {
+		printUsage();
+		return 1;
+	}
+
+	int fileDescriptor = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	unsigned char* buffer = (unsigned char*) malloc(CHUNK_SIZE);
+	if (fileDescriptor < 0 || !buffer) {
+		fprintf(stderr, "gen_data: Could not open %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	// Thresholds out of 2^32, so a draw is one compare
+	uint64_t symbolThreshold = (uint64_t) (density * 4294967296.0);
+	uint64_t holeThreshold = (uint64_t) (holeFraction * 4294967296.0);
+	Generator generator;
+	for (long long chunk = 0; chunk * CHUNK_SIZE < size; chunk++) {
+		long long offset = chunk * CHUNK_SIZE;
+		int length = size - offset < CHUNK_SIZE ? (int) (size - offset) : CHUNK_SIZE;
+		seed(&generator, seedValue, chunk);
+		if ((next(&generator) >> 32) < holeThreshold) { // Hole
+			continue;
+		}
+
+		for (int i = 0; i < length; i++) {
+			uint64_t draw = next(&generator);
+			if ((draw >> 32) < symbolThreshold) {
+				buffer[i] = symbol;
+			}
+			else { // One of the other 255, evenly
+				unsigned char byte = (unsigned char) ((draw & 0xffffffff) % 255);
+				buffer[i] = byte >= symbol ? byte + 1 : byte;
+			}
+		}
+
+		for (int written = 0; written < length; ) {
+			ssize_t ret = pwrite(fileDescriptor, buffer + written, length - written, offset + written);
+			if (ret < 0) {
+				fprintf(stderr, "gen_data: Could not write %s: %s\n", argv[optind], strerror(errno));
+				return 1;
+			}
+			written += ret;
+		}
+	}
+
+	if (ftruncate(fileDescriptor, size) || close(fileDescriptor)) { // For a trailing hole
+		fprintf(stderr, "gen_data: Could not write %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	free(buffer);
+	return 0;
+}
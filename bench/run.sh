@@ -0,0 +1,87 @@
+#!/bin/bash
+# Runs every tool over the same generated inputs, with fixed parameters, and
+# appends a line per run to a CSV - labelled with the commit, so runs from
+# different commits can go in the same file and be compared.
+# Run from bench/, after make (make bench does both). From the environment:
+#   SIZES (default "64K 16M 256M", up to tens of G is fine), DATA (default
+#   /tmp/bench_data), OUTPUT (default ./bench.csv), DENSITY (of the searched
+#   symbol, default 0.01), HOLES (fraction of chunks in sparse inputs, default
+#   0.9), THREADS (hw4 and pcc_server workers, default all), PORT (default
+#   9123), PCC_REQUESTS and PCC_LENGTH (default 256 of 1M each).
+SIZES=${SIZES:-64K 16M 256M}
+DATA=${DATA:-/tmp/bench_data}
+OUTPUT=$(realpath -m ${OUTPUT:-./bench.csv})
+DENSITY=${DENSITY:-0.01}
+HOLES=${HOLES:-0.9}
+THREADS=${THREADS:-$(nproc)}
+PORT=${PORT:-9123}
+PCC_REQUESTS=${PCC_REQUESTS:-256}
+PCC_LENGTH=${PCC_LENGTH:-1048576}
+LABEL=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)$(git diff --quiet HEAD 2>/dev/null || echo +)
+BENCH=$(pwd)
+
+run() { # NAME BYTES DIRECTORY COMMAND...
+	local name=$1 bytes=$2 directory=$3
+	shift 3
+	echo "bench: $name" >&2
+	(cd $directory && $BENCH/bench_run -o $OUTPUT -l $LABEL -n $name -b $bytes -- "$@" > /dev/null) || exit 1
+}
+
+mkdir -p $DATA || exit 1
+for SIZE in $SIZES; do
+	for i in 0 1 2 3; do # Dense and sparse, four of each for hw4
+		$BENCH/gen_data -s $i -d $DENSITY $DATA/dense_${SIZE}_$i $SIZE || exit 1
+		$BENCH/gen_data -s $i -d $DENSITY -H $HOLES $DATA/sparse_${SIZE}_$i $SIZE || exit 1
+	done
+	BYTES=$(stat -c %s $DATA/dense_${SIZE}_0)
+
+	run ex2_sym_mng_$SIZE $BYTES ../ex2 ./sym_mng $DATA/dense_${SIZE}_0 abc
+	run ex2_sym_count_string_$SIZE $BYTES ../ex2 ./sym_count -n $DATA/dense_${SIZE}_0 abc
+	rm -f $DATA/dense_${SIZE}_0.symidx
+	run ex2_sym_count_index_build_$SIZE $BYTES ../ex2 ./sym_count $DATA/dense_${SIZE}_0 a
+	run ex2_sym_count_index_$SIZE $BYTES ../ex2 ./sym_count $DATA/dense_${SIZE}_0 a
+	rm -f $DATA/dense_${SIZE}_0.symidx
+
+	run hw4_dense_$SIZE $((BYTES * 4)) ../ex4 ./hw4 -t $THREADS $DATA/hw4.out $DATA/dense_${SIZE}_{0,1,2,3}
+	run hw4_dense_q_$SIZE $((BYTES * 4)) ../ex4 ./hw4 -t $THREADS -q $DATA/hw4.q $DATA/hw4.out $DATA/dense_${SIZE}_{0,1,2,3}
+	run hw4_sparse_$SIZE $((BYTES * 4)) ../ex4 ./hw4 -t $THREADS $DATA/hw4.out $DATA/sparse_${SIZE}_{0,1,2,3}
+	rm -f $DATA/hw4.out $DATA/hw4.q
+
+	# The same dense inputs compressed, decoded on the way in - zstd too, if the tools
+	# were built with it (the same check as ../libcount/decode.mk) and its CLI's around
+	for FORMAT in gz $(printf '#include <zstd.h>\n' | ${CC:-cc} -E - > /dev/null 2>&1 && command -v zstd > /dev/null && echo zst); do
+		for i in 0 1 2 3; do
+			[ $FORMAT = gz ] && gzip -1 -c $DATA/dense_${SIZE}_$i > $DATA/dense_${SIZE}_$i.gz
+			[ $FORMAT = zst ] && zstd -q -T0 -f -c $DATA/dense_${SIZE}_$i > $DATA/dense_${SIZE}_$i.zst
+		done
+		run ex2_sym_count_${FORMAT}_$SIZE $BYTES ../ex2 ./sym_count -n $DATA/dense_${SIZE}_0.$FORMAT abc
+		run hw4_dense_${FORMAT}_$SIZE $((BYTES * 4)) ../ex4 ./hw4 -t $THREADS $DATA/hw4.out $DATA/dense_${SIZE}_{0,1,2,3}.$FORMAT
+		rm -f $DATA/hw4.out $DATA/dense_${SIZE}_?.$FORMAT
+	done
+done
+
+# ex1 stops at every match and its manager checks in once a second - a bound of 1
+# on the smallest input is all that's worth timing
+SMALLEST=${SIZES%% *}
+run ex1_sym_mng_$SMALLEST $(stat -c %s $DATA/dense_${SMALLEST}_0) ../ex1 ./sym_mng $DATA/dense_${SMALLEST}_0 a 1
+
+# The server runs under its own runner, stopped with SIGINT once the client's done -
+# its row has no throughput, its wall time's mostly waiting. It only makes its admin
+# socket once its listeners are up, so the client starts as soon as that's there.
+ADMIN=$DATA/pcc_server.sock
+rm -f $ADMIN
+(cd ../ex5 && exec $BENCH/bench_run -o $OUTPUT -l $LABEL -n pcc_server \
+		-- ./pcc_server -w $THREADS -a $ADMIN $PORT > /dev/null) &
+SERVER=$!
+until [ -S $ADMIN ]; do
+	if ! kill -0 $SERVER 2> /dev/null; then
+		echo "bench: pcc_server didn't start" >&2
+		exit 1
+	fi
+	sleep 0.05
+done
+run pcc_client $((PCC_REQUESTS * PCC_LENGTH)) ../ex5 ./pcc_client -n $PCC_REQUESTS 127.0.0.1 $PORT $PCC_LENGTH
+kill -INT $SERVER
+wait $SERVER || exit 1
+
+echo "bench: results in $OUTPUT" >&2
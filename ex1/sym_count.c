@@ -1,3 +1,4 @@
+#include "count.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -9,11 +10,11 @@
 #define BUFFER_SIZE 1024
 
 int processId, fileDescriptor, count;
-char c;
+char* pattern; // A single character, or a whole string
 
 void sigtermHandler(int signalNo) {
 	if (signalNo == SIGTERM) {
-		printf("Process %d finishes. Symbol %c. Instances %d\n", processId, c, count);
+		printf("Process %d finishes. Symbol %s. Instances %d\n", processId, pattern, count);
 		close(fileDescriptor);
 		if (errno) {
 			exit(errno);
@@ -30,7 +31,8 @@ void sigcontHandler(int signalNo) {
 
 int main(int argc, char* argv[]) {
 	processId = getpid();
-	c = argv[2][0];
+	pattern = argv[2];
+	int patternLength = strlen(pattern);
 
 	if (signal(SIGTERM, sigtermHandler) == SIG_ERR ||
 			signal(SIGCONT, sigcontHandler) == SIG_ERR) {
@@ -44,19 +46,32 @@ int main(int argc, char* argv[]) {
 		raise(SIGTERM);
 	}
 
-	char buffer[BUFFER_SIZE + 1];
-	int readBytes;
+	if (!patternLength) {
+		printf("Empty pattern\n");
+		raise(SIGTERM);
+	}
+
+	// The last patternLength - 1 bytes of a chunk are carried over to the front of the
+	// next one, so matches across chunks are found too
+	char* buffer = (char*) malloc(patternLength - 1 + BUFFER_SIZE);
+	if (!buffer) {
+		printf("Could not allocate buffer for process %d.\n", processId);
+		raise(SIGTERM);
+	}
+	int readBytes, carried = 0;
 
-	while ((readBytes = read(fileDescriptor, buffer, BUFFER_SIZE)) >= 0) {
-		for (int i = 0; i < readBytes; i++) {
-			if (buffer[i] == c) {
-				count++;
-				printf("Process %d, symbol %c, going to sleep\n", processId, c);
-				raise(SIGSTOP);
-			}
+	while ((readBytes = read(fileDescriptor, buffer + carried, BUFFER_SIZE)) >= 0) {
+		int available = carried + readBytes;
+		for (uint64_t matches = countSubstring(buffer, available, pattern, patternLength); matches; matches--) {
+			count++;
+			printf("Process %d, symbol %s, going to sleep\n", processId, pattern);
+			raise(SIGSTOP);
 		}
 
-		if (readBytes < BUFFER_SIZE) {
+		carried = available < patternLength - 1 ? available : patternLength - 1; // Not tried as a start yet
+		memmove(buffer, buffer + available - carried, carried);
+
+		if (!readBytes) { // Only the end of the file - a short read needn't be
 			raise(SIGTERM);
 		}
 	}
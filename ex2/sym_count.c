@@ -1,25 +1,70 @@
+#include "count.h"
+#include "decode.h"
+#include "sym_search.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-int processId, fileDescriptor, counter, length; // Global for signal handlers
-char symbol, *addr;
+#define WINDOW_SIZE (64 * 1024 * 1024) // Mapped at a time, so files of any size fit - a multiple of the page size
+#define CHUNK_SIZE (256 * 1024) // Each pattern's searched for in a chunk while it's still in cache
+#define SEARCH_PATTERNS_LIMIT 16 // More patterns than this and one automaton pass beats a search per pattern
+
+#define BLOCK_SIZE (1024 * 1024) // Of the index - windows hold a whole number of them
+#define INDEX_MAGIC "SYMIDX01"
+#define INDEX_SUFFIX ".symidx"
+#define TEMPORARY_SUFFIX ".XXXXXX" // For mkstemp
+#define FINGERPRINT_SIZE 4096 // Bytes at the end of what's indexed, to tell an append from a rewrite
+
+#define EVENTS_SIZE 4096 // inotify events read at a time
+
+/***
+ * The sidecar index - this header, then a 256-bin histogram per BLOCK_SIZE block of the
+ * file, the last one possibly partial. It's a local cache, so it's in native byte order.
+ */
+typedef struct index_header_t {
+	char magic[8];
+	uint64_t device;
+	uint64_t inode;
+	uint64_t size; // Of the file, when indexed
+	int64_t modifiedSeconds;
+	int64_t modifiedNanoseconds;
+	uint64_t fingerprint; // Of the last FINGERPRINT_SIZE bytes indexed
+	uint64_t totals[256]; // The whole file's, so whole-file queries don't read the blocks
+} IndexHeader;
+
+int processId, fileDescriptor, numberOfPatterns; // Global for signal handlers
+char** patterns;
+char* addr = NULL;
+size_t length; // Of the current mapping
+uint64_t* counters;
+
+size_t* patternLengths;
+size_t maximumPatternLength = 0;
+SymAutomaton* automaton = NULL; // Many patterns, one pass
+struct stat fileStat;
+SymAutomaton* follower = NULL; // Follow mode's - its state is wherever the file's been counted up to
+off_t followed; // Bytes of the file counted so far, in follow mode
 
 void sigPipeHandler(int signal) {
 	if (signal == SIGPIPE) {
-		fprintf(stderr, "SIGPIPE for process %d. Symbol %c. Counter %d.\n", processId, symbol, counter);
+		for (int i = 0; i < numberOfPatterns; i++) {
+			fprintf(stderr, "SIGPIPE for process %d. Symbol %s. Counter %llu.\n", processId, patterns[i], (unsigned long long) counters[i]);
+		}
 		raise(SIGTERM); // For cleanup
 	}
 }
 
 void sigTermHandler(int signal) {
 	if (signal == SIGTERM) {
-		if (munmap(addr, length) < 0 | close(fileDescriptor) < 0) { // Un-map from memory, and close file
+		if ((addr && munmap(addr, length) < 0) | (close(fileDescriptor) < 0)) { // Un-map from memory, and close file
 			exit(errno); // Error?
 		}
 
@@ -27,9 +72,414 @@ void sigTermHandler(int signal) {
 	}
 }
 
+/***
+ * Maps length bytes of the file from offset, which needn't be page aligned. Returns
+ * where offset ended up.
+ */
+char* mapWindow(off_t offset, size_t windowLength) {
+	off_t aligned = offset & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+	length = windowLength + (offset - aligned);
+	addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileDescriptor, aligned); // Map file to memory
+	if (addr == MAP_FAILED) {
+		addr = NULL;
+		fprintf(stderr, "Could not map file to virtual memory in process %d.\n", processId);
+		raise(SIGTERM);
+	}
+	madvise(addr, length, MADV_SEQUENTIAL);
+
+	return addr + (offset - aligned);
+}
+
+void unmapWindow() {
+	if (munmap(addr, length) < 0) {
+		fprintf(stderr, "Could not unmap file in process %d.\n", processId);
+		raise(SIGTERM);
+	}
+	addr = NULL;
+}
+
+/***
+ * Adds the matches lying wholly in [start, end) to counters.
+ */
+void scanRange(off_t start, off_t end) {
+	if (automaton) {
+		automaton->state = 0;
+	}
+
+	for (off_t offset = start; offset < end; offset += WINDOW_SIZE) {
+		size_t windowLength = end - offset < WINDOW_SIZE ? (size_t) (end - offset) : WINDOW_SIZE;
+		size_t mappedLength = windowLength;
+		if (!automaton) { // Overlap the next window by a pattern less a byte, for the matches across the seam
+			mappedLength = end - offset < (off_t) (WINDOW_SIZE + maximumPatternLength - 1)
+					? (size_t) (end - offset) : WINDOW_SIZE + maximumPatternLength - 1;
+		}
+		char* window = mapWindow(offset, mappedLength);
+
+		if (automaton) { // Its state carries over to the next window
+			symAutomatonScan(automaton, window, windowLength, counters);
+		}
+		else {
+			for (size_t chunk = 0; chunk < windowLength; chunk += CHUNK_SIZE) {
+				size_t chunkLength = windowLength - chunk < CHUNK_SIZE ? windowLength - chunk : CHUNK_SIZE;
+				for (int i = 0; i < numberOfPatterns; i++) { // Only matches starting in the chunk fit in what's searched
+					size_t searchLength = chunkLength + patternLengths[i] - 1;
+					counters[i] += countSubstring(window + chunk, searchLength < mappedLength - chunk ? searchLength : mappedLength - chunk,
+							patterns[i], patternLengths[i]);
+				}
+			}
+		}
+
+		unmapWindow();
+	}
+}
+
+/***
+ * scanRange for compressed files, over their decoded bytes from start to end (-1 for all
+ * of them) as they come off the decoder. There's no mapping those, so getting to start
+ * means decoding up to it, and instead of overlapping windows, a pattern less a byte of
+ * each chunk's carried to the front of the next.
+ */
+void scanDecoded(int format, off_t start, off_t end) {
+	int descriptor = dup(fileDescriptor); // The decoder closes its own, the handlers close ours
+	Decoder* decoder = descriptor < 0 ? NULL : decodeStart(descriptor, format, (int) sysconf(_SC_NPROCESSORS_ONLN));
+	char* buffer = (char*) malloc(CHUNK_SIZE + maximumPatternLength - 1);
+	if (!decoder || !buffer) {
+		fprintf(stderr, "Could not decode the %s file for process %d.\n", decodeFormatName(format), processId);
+		raise(SIGTERM);
+	}
+	if (automaton) {
+		automaton->state = 0;
+	}
+
+	off_t offset = 0;
+	size_t carried = 0;
+	ssize_t readBytes = 0;
+	while ((end < 0 || offset < end) && (readBytes = decodeRead(decoder, buffer + carried,
+			end < 0 || end - offset > CHUNK_SIZE ? CHUNK_SIZE : (size_t) (end - offset))) > 0) {
+		size_t skipped = offset < start ? (start - offset < readBytes ? (size_t) (start - offset) : (size_t) readBytes) : 0;
+		offset += readBytes;
+		if (skipped) { // Nothing's carried before start
+			memmove(buffer, buffer + skipped, readBytes - skipped);
+		}
+		size_t filled = carried + readBytes - skipped;
+
+		if (automaton) { // Its state carries over instead
+			symAutomatonScan(automaton, buffer + carried, filled - carried, counters);
+		}
+		else {
+			for (int i = 0; i < numberOfPatterns; i++) { // Matches ending in what was carried were counted last time
+				size_t from = carried > patternLengths[i] - 1 ? carried - (patternLengths[i] - 1) : 0;
+				counters[i] += countSubstring(buffer + from, filled - from, patterns[i], patternLengths[i]);
+			}
+		}
+
+		carried = filled < maximumPatternLength - 1 ? filled : maximumPatternLength - 1;
+		memmove(buffer, buffer + filled - carried, carried);
+	}
+
+	decodeFinish(decoder);
+	free(buffer);
+	if (readBytes < 0) {
+		fprintf(stderr, "The %s file is corrupt or truncated, for process %d.\n", decodeFormatName(format), processId);
+		raise(SIGTERM);
+	}
+}
+
+/***
+ * FNV-1a of the last FINGERPRINT_SIZE bytes before size - if they're still there
+ * after the file grew, it was appended to rather than rewritten.
+ */
+uint64_t fingerprint(uint64_t size) {
+	unsigned char buffer[FINGERPRINT_SIZE];
+	off_t start = size < FINGERPRINT_SIZE ? 0 : size - FINGERPRINT_SIZE;
+	ssize_t readBytes = pread(fileDescriptor, buffer, size - start, start);
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (ssize_t i = 0; i < readBytes; i++) {
+		hash ^= buffer[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return readBytes == (ssize_t) (size - start) ? hash : 0;
+}
+
+/***
+ * Histograms blocks from firstBlock to the end of the file.
+ */
+void indexBlocks(uint32_t (*blocks)[256], uint64_t firstBlock) {
+	for (off_t offset = firstBlock * BLOCK_SIZE; offset < fileStat.st_size; offset += WINDOW_SIZE) {
+		size_t windowLength = fileStat.st_size - offset < WINDOW_SIZE ? (size_t) (fileStat.st_size - offset) : WINDOW_SIZE;
+		char* window = mapWindow(offset, windowLength);
+		for (size_t block = 0; block < windowLength; block += BLOCK_SIZE) {
+			uint64_t histogram[256] = { 0 };
+			countHistogram(window + block, windowLength - block < BLOCK_SIZE ? windowLength - block : BLOCK_SIZE, histogram);
+			for (int c = 0; c < 256; c++) { // A block's counts fit in 32 bits
+				blocks[(offset + block) / BLOCK_SIZE][c] = (uint32_t) histogram[c];
+			}
+		}
+
+		unmapWindow();
+	}
+}
+
+/***
+ * Written to a temporary file and renamed over, so a reader never sees half an index.
+ * The temporary file's name is unique, since sym_mng runs several of us on the same
+ * file. It's only a cache - if it can't be written, the next run just scans again.
+ */
+void saveIndex(const char* indexPath, IndexHeader* header, uint32_t (*blocks)[256], uint64_t numberOfBlocks) {
+	char temporaryPath[strlen(indexPath) + sizeof(TEMPORARY_SUFFIX)];
+	sprintf(temporaryPath, "%s%s", indexPath, TEMPORARY_SUFFIX);
+	int file = mkstemp(temporaryPath);
+	if (file < 0) {
+		return;
+	}
+	fchmod(file, 0644); // mkstemp's 0600, but anyone who can read the file may as well use its index
+
+	size_t blocksSize = numberOfBlocks * sizeof(*blocks);
+	if (write(file, header, sizeof(*header)) != sizeof(*header) || write(file, blocks, blocksSize) != (ssize_t) blocksSize) {
+		close(file);
+		unlink(temporaryPath);
+		return;
+	}
+	close(file);
+
+	if (rename(temporaryPath, indexPath) < 0) {
+		unlink(temporaryPath);
+	}
+}
+
+/***
+ * Brings the index up to date, and returns it open for reading blocks from - or -1 if
+ * there's none to be had. Blocks are only rescanned from the last one indexed if the
+ * file was appended to, and from scratch if it was replaced or rewritten.
+ */
+int updateIndex(const char* indexPath, IndexHeader* header) {
+	uint64_t numberOfBlocks = (fileStat.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint64_t firstBlock = 0; // To scan
+	IndexHeader old;
+	int index = open(indexPath, O_RDONLY);
+	if (index >= 0 && read(index, &old, sizeof(old)) == sizeof(old) && !memcmp(old.magic, INDEX_MAGIC, sizeof(old.magic))
+			&& old.device == (uint64_t) fileStat.st_dev && old.inode == (uint64_t) fileStat.st_ino) {
+		if (old.size == (uint64_t) fileStat.st_size && old.modifiedSeconds == fileStat.st_mtim.tv_sec
+				&& old.modifiedNanoseconds == fileStat.st_mtim.tv_nsec) { // Untouched
+			*header = old;
+			return index;
+		}
+		if (old.size < (uint64_t) fileStat.st_size && old.fingerprint == fingerprint(old.size)) { // Appended to
+			firstBlock = old.size / BLOCK_SIZE; // The last, partial block got more
+		}
+	}
+
+	uint32_t (*blocks)[256] = (uint32_t(*)[256]) calloc(numberOfBlocks ? numberOfBlocks : 1, sizeof(*blocks));
+	if (!blocks) {
+		if (index >= 0) {
+			close(index);
+		}
+		return -1;
+	}
+	if (firstBlock && pread(index, blocks, firstBlock * sizeof(*blocks), sizeof(old)) != (ssize_t) (firstBlock * sizeof(*blocks))) {
+		firstBlock = 0; // Short index, start over
+	}
+	if (index >= 0) {
+		close(index);
+	}
+
+	indexBlocks(blocks, firstBlock);
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+	header->device = fileStat.st_dev;
+	header->inode = fileStat.st_ino;
+	header->size = fileStat.st_size;
+	header->modifiedSeconds = fileStat.st_mtim.tv_sec;
+	header->modifiedNanoseconds = fileStat.st_mtim.tv_nsec;
+	header->fingerprint = fingerprint(fileStat.st_size);
+	for (uint64_t block = 0; block < numberOfBlocks; block++) {
+		for (int c = 0; c < 256; c++) {
+			header->totals[c] += blocks[block][c];
+		}
+	}
+	saveIndex(indexPath, header, blocks, numberOfBlocks);
+	free(blocks);
+
+	return open(indexPath, O_RDONLY);
+}
+
+/***
+ * Single characters only - each pattern's count is the sum of its byte's bins. Whole
+ * blocks in the range come from the index, the ragged ends are scanned.
+ */
+int countFromIndex(const char* indexPath, off_t start, off_t end) {
+	IndexHeader header;
+	int index = updateIndex(indexPath, &header);
+	if (index < 0) {
+		return -1;
+	}
+
+	if (!start && end == fileStat.st_size) { // The totals have it all
+		for (int i = 0; i < numberOfPatterns; i++) {
+			counters[i] = header.totals[(unsigned char) patterns[i][0]];
+		}
+		close(index);
+		return 0;
+	}
+
+	off_t firstBlock = (start + BLOCK_SIZE - 1) / BLOCK_SIZE, lastBlock = end / BLOCK_SIZE; // Whole blocks in the range
+	if (firstBlock >= lastBlock) { // Not a single whole block
+		close(index);
+		scanRange(start, end);
+		return 0;
+	}
+
+	uint32_t histogram[256];
+	for (off_t block = firstBlock; block < lastBlock; block++) {
+		if (pread(index, histogram, sizeof(histogram), sizeof(header) + block * sizeof(histogram)) != sizeof(histogram)) {
+			close(index);
+			memset(counters, 0, numberOfPatterns * sizeof(uint64_t));
+			return -1;
+		}
+		for (int i = 0; i < numberOfPatterns; i++) {
+			counters[i] += histogram[(unsigned char) patterns[i][0]];
+		}
+	}
+	close(index);
+
+	scanRange(start, firstBlock * BLOCK_SIZE);
+	scanRange(lastBlock * BLOCK_SIZE, end);
+	return 0;
+}
+
+void printCounts(const char* status) {
+	for (int i = 0; i < numberOfPatterns; i++) {
+		for (int j = 0; j < i; j++) { // The automaton only counts the first of identical patterns
+			if (!strcmp(patterns[i], patterns[j])) {
+				counters[i] = counters[j];
+				break;
+			}
+		}
+
+		// Because of dup2 in the parent, sent to pipe
+		printf("Process %d %s. Symbol %s. Instances %llu.\n", processId, status, patterns[i], (unsigned long long) counters[i]);
+	}
+
+	fflush(stdout); // A whole update per write, for sym_mng to pass along
+}
+
+/***
+ * Counts whatever's been appended since last time. The follower's state carries over,
+ * so a match that straddles the old end is counted once it's complete. Returns whether
+ * there was anything new.
+ */
+int catchUp() {
+	if (fstat(fileDescriptor, &fileStat) < 0) {
+		fprintf(stderr, "Could not get file's stat for process %d.\n", processId);
+		raise(SIGTERM);
+	}
+
+	if (fileStat.st_size < followed) { // Truncated - count what's written from the top
+		fprintf(stderr, "File truncated for process %d.\n", processId);
+		followed = 0;
+		follower->state = 0;
+	}
+	if (fileStat.st_size == followed) {
+		return 0;
+	}
+
+	for (off_t offset = followed; offset < fileStat.st_size; offset += WINDOW_SIZE) {
+		size_t windowLength = fileStat.st_size - offset < WINDOW_SIZE ? (size_t) (fileStat.st_size - offset) : WINDOW_SIZE;
+		symAutomatonScan(follower, mapWindow(offset, windowLength), windowLength, counters);
+		unmapWindow();
+	}
+
+	followed = fileStat.st_size;
+	return 1;
+}
+
+/***
+ * Gets the follower to where the count left off, without counting anything twice - its
+ * state only depends on the last pattern's length less a byte.
+ */
+void startFollowing() {
+	uint64_t* discarded = (uint64_t*) calloc((unsigned) numberOfPatterns, sizeof(uint64_t));
+	if (!(follower = symAutomatonCreate(patterns, numberOfPatterns)) || !discarded) {
+		fprintf(stderr, "Could not allocate memory for patterns in process %d.\n", processId);
+		raise(SIGTERM);
+	}
+
+	followed = fileStat.st_size;
+	off_t start = followed < (off_t) (maximumPatternLength - 1) ? 0 : followed - (maximumPatternLength - 1);
+	if (start < followed) {
+		symAutomatonScan(follower, mapWindow(start, followed - start), followed - start, discarded);
+		unmapWindow();
+	}
+	free(discarded);
+}
+
+/***
+ * Follows the file until killed, printing the counts whenever they change. If the file
+ * is renamed or deleted, and another takes its name - log rotation - what's left of the
+ * old one is counted and the new one is followed from its start.
+ */
+void follow(char* filePath) {
+	char directoryPath[strlen(filePath) + 1], namePath[strlen(filePath) + 1];
+	strcpy(directoryPath, filePath);
+	strcpy(namePath, filePath);
+	char* name = basename(namePath);
+
+	int inotifyDescriptor = inotify_init();
+	int fileWatch = inotifyDescriptor < 0 ? -1 : inotify_add_watch(inotifyDescriptor, filePath,
+			IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
+	int directoryWatch = inotifyDescriptor < 0 ? -1 : inotify_add_watch(inotifyDescriptor, dirname(directoryPath),
+			IN_CREATE | IN_MOVED_TO);
+	if (fileWatch < 0 || directoryWatch < 0) {
+		fprintf(stderr, "Could not watch the file for process %d.\n", processId);
+		raise(SIGTERM);
+	}
+
+	char events[EVENTS_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t readBytes = 0;
+	int replaced = 1; // Nothing was watched while the file was counted - a pass for whatever happened meanwhile comes first
+	do {
+		for (char* next = events; next < events + readBytes; ) {
+			struct inotify_event* event = (struct inotify_event*) next;
+			if ((event->wd == directoryWatch && event->len && !strcmp(event->name, name))
+					|| (event->wd == fileWatch && event->mask & (IN_MOVE_SELF | IN_DELETE_SELF))) {
+				replaced = 1;
+			}
+			next += sizeof(struct inotify_event) + event->len;
+		}
+
+		int changed = catchUp(); // Whatever made it into the old one first
+		if (replaced) {
+			struct stat newStat;
+			int newDescriptor = open(filePath, O_RDONLY);
+			if (newDescriptor >= 0 && (fstat(newDescriptor, &newStat) < 0 || newStat.st_ino == fileStat.st_ino)) {
+				close(newDescriptor); // Still the same file
+			}
+			else if (newDescriptor >= 0) {
+				fprintf(stderr, "File replaced for process %d.\n", processId);
+				inotify_rm_watch(inotifyDescriptor, fileWatch);
+				fileWatch = inotify_add_watch(inotifyDescriptor, filePath, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
+				close(fileDescriptor);
+				fileDescriptor = newDescriptor;
+				followed = 0;
+				follower->state = 0;
+				changed |= catchUp();
+			} // Otherwise gone for now - the directory watch says when it's back
+		}
+
+		if (changed) {
+			printCounts("update");
+		}
+		replaced = 0;
+	} while ((readBytes = read(inotifyDescriptor, events, sizeof(events))) > 0 || errno == EINTR);
+
+	fprintf(stderr, "Could not read file events for process %d.\n", processId);
+	raise(SIGTERM);
+}
+
 int main(int argc, char* argv[]) {
 	processId = getpid();
-	symbol = argv[2][0];
 
 	if (signal(SIGPIPE, sigPipeHandler) == SIG_ERR || // Register handlers
 		signal(SIGTERM, sigTermHandler) == SIG_ERR) {
@@ -37,32 +487,91 @@ int main(int argc, char* argv[]) {
 		raise(SIGTERM);
 	}
 
-	fileDescriptor = open(argv[1], O_RDONLY); // Open file prior to mapping to memory
+	// Options only before the file - patterns after it may well start with a '-'
+	int useIndex = 1, following = 0, option;
+	long long rangeStart = 0, rangeEnd = -1;
+	while ((option = getopt(argc, argv, "+fnr:")) != -1) {
+		switch (option) {
+			case 'f':
+				following = 1;
+				break;
+			case 'n':
+				useIndex = 0;
+				break;
+			case 'r':
+				if (sscanf(optarg, "%lld:%lld", &rangeStart, &rangeEnd) != 2 || rangeStart < 0 || rangeEnd < rangeStart) {
+					fprintf(stderr, "Invalid range %s for process %d.\n", optarg, processId);
+					raise(SIGTERM);
+				}
+				break;
+			default:
+				fprintf(stderr, "USAGE: ./sym_count [-f | -r START:END] [-n] <FILE> <PATTERN> [PATTERN ...]\n");
+				raise(SIGTERM);
+		}
+	}
+
+	patterns = argv + optind + 1; // A single character is just a very short pattern
+	numberOfPatterns = argc - optind - 1;
+	if (numberOfPatterns < 1 || (following && rangeEnd >= 0)) {
+		fprintf(stderr, "USAGE: ./sym_count [-f | -r START:END] [-n] <FILE> <PATTERN> [PATTERN ...]\n");
+		raise(SIGTERM);
+	}
+	for (int i = 0; i < numberOfPatterns; i++) {
+		if (!patterns[i][0]) {
+			fprintf(stderr, "Empty pattern for process %d.\n", processId);
+			raise(SIGTERM);
+		}
+	}
+
+	counters = (uint64_t*) calloc((unsigned) numberOfPatterns, sizeof(uint64_t));
+	patternLengths = (size_t*) malloc((unsigned) numberOfPatterns * sizeof(size_t));
+	if (!counters || !patternLengths || (numberOfPatterns > SEARCH_PATTERNS_LIMIT
+			&& !(automaton = symAutomatonCreate(patterns, numberOfPatterns)))) {
+		fprintf(stderr, "Could not allocate memory for patterns in process %d.\n", processId);
+		raise(SIGTERM);
+	}
+	for (int i = 0; i < numberOfPatterns; i++) {
+		patternLengths[i] = strlen(patterns[i]);
+		maximumPatternLength = patternLengths[i] > maximumPatternLength ? patternLengths[i] : maximumPatternLength;
+	}
+
+	char* filePath = argv[optind];
+	fileDescriptor = open(filePath, O_RDONLY); // Open file prior to mapping to memory
 	if (fileDescriptor == -1) {
 		fprintf(stderr, "An error occurred while opening the file for process %d.\n", processId);
 		raise(SIGTERM);
 	}
 
-	struct stat fileStat;
 	if (fstat(fileDescriptor, &fileStat) < 0) { // To calculate size of file
 		fprintf(stderr, "Could not get file's stat for process %d.\n", processId);
 		raise(SIGTERM);
 	}
 
-	length = fileStat.st_size;
-	addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileDescriptor, 0); // Map file to memory
-	if (addr == MAP_FAILED) {
-		fprintf(stderr, "Could not map file to virtual memory in process %d.\n", processId);
+	int format = decodeFormat(fileDescriptor);
+	if (format != DECODE_NONE && following) { // Appends to a compressed stream aren't something we can count
+		fprintf(stderr, "Can't follow a %s file for process %d.\n", decodeFormatName(format), processId);
 		raise(SIGTERM);
 	}
 
-	for (int i = 0; i < length; i++) { // Read file (in memory! woot!)
-		if (addr[i] == symbol) {
-			counter++;
-		}
+	off_t start = rangeStart < fileStat.st_size ? rangeStart : fileStat.st_size;
+	off_t end = rangeEnd < 0 || rangeEnd > fileStat.st_size ? fileStat.st_size : rangeEnd;
+	char indexPath[strlen(filePath) + sizeof(INDEX_SUFFIX)];
+	sprintf(indexPath, "%s%s", filePath, INDEX_SUFFIX);
+	if (format != DECODE_NONE) { // Ranges are of the decoded bytes
+		scanDecoded(format, rangeStart, rangeEnd);
+	}
+	else if (maximumPatternLength > 1 || !S_ISREG(fileStat.st_mode) || !useIndex || countFromIndex(indexPath, start, end) < 0) {
+		scanRange(start, end);
 	}
 
-	printf("Process %d finished. Symbol %c. Instances %d.\n", processId, symbol, counter); // Because of dup2 in the parent, sent to pipe
+	if (following) {
+		printCounts("counted");
+		startFollowing();
+		follow(filePath);
+	}
 
+	printCounts("finished");
+	symAutomatonFree(automaton);
+	free(patternLengths);
 	raise(SIGTERM);
 }
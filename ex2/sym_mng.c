@@ -1,12 +1,17 @@
+#define _GNU_SOURCE // For ppoll
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#define LINE_SIZE 256 // Longest line a child prints, with room to spare
+
 int patternLength, processId, *childProcesses, *pipeDescriptors; // For the clean up function, that might be called from the SIGPIPE handler
+volatile sig_atomic_t stopping = 0; // SIGTERM or SIGINT came, the main loop cleans up
 
 int cleanUp() {
 	for (int i = 0; i < patternLength; i++) {
@@ -28,8 +33,26 @@ void sigPipeHandler(int signal) {
 	}
 }
 
+void sigTermHandler(int signal) { // Followers never finish on their own, so they go with the manager
+	if (signal == SIGTERM || signal == SIGINT) {
+		stopping = 1; // Only flags it - killing and freeing isn't safe in here
+	}
+}
+
 int main(int argc, char* argv[]) {
 	processId = getpid(); // For SIGPIPE handler
+	if (signal(SIGTERM, sigTermHandler) == SIG_ERR || signal(SIGINT, sigTermHandler) == SIG_ERR) {
+		printf("Could not register handlers for manager process %d.\n", processId);
+		return 1;
+	}
+
+	int following = argc > 1 && !strcmp(argv[1], "-f"); // Children keep counting as the file grows
+	argv += following;
+	argc -= following;
+	if (argc != 3) {
+		printf("USAGE: ./sym_mng [-f] <FILE> <PATTERN>\n");
+		return 1;
+	}
 	patternLength = strlen(argv[2]);
 
 	childProcesses = (int*) malloc(patternLength * sizeof(int));
@@ -45,8 +68,9 @@ int main(int argc, char* argv[]) {
 		raise(SIGTERM);
 	}
 
-	char stringChar[2];
-	char* processArguments[] = {"./sym_count", argv[1], NULL, NULL}; // Arguments for child
+	char stringChar[2] = {0};
+	char* processArguments[] = {"./sym_count", "-f", argv[1], NULL, NULL}; // Arguments for child
+	char** childArguments = processArguments + !following; // Without the -f, unless following
 	int pid;
 
 	for (int i = 0; i < patternLength; i++) {
@@ -57,7 +81,7 @@ int main(int argc, char* argv[]) {
 		}
 
 		stringChar[0] = argv[2][i]; // Next character in pattern
-		processArguments[2] = stringChar;
+		processArguments[3] = stringChar;
 
 		pid = fork();
 		if (pid > 0) { // Father
@@ -69,7 +93,8 @@ int main(int argc, char* argv[]) {
 			dup2(pipeFds[1], STDOUT_FILENO); // Child's stdout is pipe!
 			close(pipeFds[0]); // Close pipe
 			close(pipeFds[1]);
-			if (execvp(processArguments[0], processArguments) == -1) { // Run sym_count
+			childArguments[0] = processArguments[0];
+			if (execvp(childArguments[0], childArguments) == -1) { // Run sym_count
 				printf("%s\n", strerror(errno)); // Error happened
 				return cleanUp();
 			}
@@ -82,39 +107,82 @@ int main(int argc, char* argv[]) {
 
 	int processesLeft = patternLength;
 	int childStatus;
-	char buffer[20];
-	int readBytes;
+	char (*lines)[LINE_SIZE] = calloc((unsigned) patternLength, LINE_SIZE); // What's come of each child's current line
+	int* lineLengths = (int*) calloc((unsigned) patternLength, sizeof(int));
+	struct pollfd* pollDescriptors = (struct pollfd*) malloc(patternLength * sizeof(struct pollfd));
+	if (!lines || !lineLengths || !pollDescriptors) {
+		printf("Could not allocate memory for children's output.\n");
+		return cleanUp();
+	}
 
-	while (processesLeft > 0) { // Child still running
-		sleep(1);
+	// Blocked but while polling, so one can't slip in between checking the flag and poll
+	sigset_t stopSignals, pollMask;
+	sigemptyset(&stopSignals);
+	sigaddset(&stopSignals, SIGTERM);
+	sigaddset(&stopSignals, SIGINT);
+	sigprocmask(SIG_BLOCK, &stopSignals, &pollMask);
+
+	while (processesLeft > 0 && !stopping) { // Child still running
+		for (int i = 0; i < patternLength; i++) { // Negative descriptors are skipped
+			pollDescriptors[i].fd = pipeDescriptors[i] ? pipeDescriptors[i] : -1;
+			pollDescriptors[i].events = POLLIN;
+		}
+
+		if (ppoll(pollDescriptors, patternLength, NULL, &pollMask) < 0) { // Whoever's got something to say
+			if (errno == EINTR) { // Maybe told to stop - the loop checks
+				continue;
+			}
+			printf("%s\n", strerror(errno));
+			return cleanUp();
+		}
 
 		for (int i = 0; i < patternLength; i++) {
-			if (pipeDescriptors[i] && // Pipe isn't closed
-				(pid = waitpid(childProcesses[i], &childStatus, WNOHANG)) > 0) { // And child finished
-				if (WIFEXITED(childStatus)) { // Exited normally?
-					while ((readBytes = read(pipeDescriptors[i], buffer, 19)) > 0) { // Read a from appropriate pipe
-						buffer[readBytes] = '\0';
-						printf("%s", buffer); // Print it!
-					}
-
-					if (close(pipeDescriptors[i]) == -1) { // Close pipe
-						printf("%s\n", strerror(errno));
-						return cleanUp();
-					}
-
-					pipeDescriptors[i] = 0; // Bye bye
-					processesLeft--; // One down
-				}
+			if (!pipeDescriptors[i] || !pollDescriptors[i].revents) {
+				continue;
+			}
 
-				else { // Exited not normally?
-					return cleanUp();
+			int readBytes = read(pipeDescriptors[i], lines[i] + lineLengths[i], LINE_SIZE - lineLengths[i]);
+			if (readBytes > 0) { // Only whole lines are printed, so children's lines don't get mixed up
+				lineLengths[i] += readBytes;
+				char* end = lines[i] + lineLengths[i] - 1;
+				while (end >= lines[i] && *end != '\n') { // Back to the last newline
+					end--;
 				}
+				if (end >= lines[i]) {
+					fwrite(lines[i], 1, end + 1 - lines[i], stdout);
+					fflush(stdout);
+					lineLengths[i] -= end + 1 - lines[i];
+					memmove(lines[i], end + 1, lineLengths[i]);
+				}
+				else if (lineLengths[i] == LINE_SIZE) { // No newline in sight, so out it goes anyway
+					fwrite(lines[i], 1, LINE_SIZE, stdout);
+					lineLengths[i] = 0;
+				}
+				continue;
+			}
+			else if (readBytes < 0 && errno == EINTR) {
+				continue;
 			}
-			else if (pid < 0) { // Error waiting on pid
-				processesLeft = 0;
+
+			// End of the pipe - the child's done
+			fwrite(lines[i], 1, lineLengths[i], stdout);
+			if (waitpid(childProcesses[i], &childStatus, 0) < 0 || !WIFEXITED(childStatus)) { // Exited not normally?
+				return cleanUp();
+			}
+
+			if (close(pipeDescriptors[i]) == -1) { // Close pipe
+				printf("%s\n", strerror(errno));
+				return cleanUp();
 			}
+
+			pipeDescriptors[i] = 0; // Bye bye
+			processesLeft--; // One down
 		}
 	}
 
-	return cleanUp();
+	free(lines);
+	free(lineLengths);
+	free(pollDescriptors);
+	int error = cleanUp(); // Kills whoever's left, if we were told to stop
+	return stopping ? 0 : error;
 }
@@ -0,0 +1,126 @@
+#ifndef _SYM_SEARCH_H
+#define _SYM_SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/***
+ * Aho-Corasick, for counting many patterns in one pass. The failure links are folded
+ * into a full 256-way transition table, so scanning is one lookup per byte. The
+ * state is kept between calls, so a file can be fed in any number of pieces and
+ * matches across the seams are still found.
+ */
+typedef struct sym_automaton_t {
+	int numberOfStates;
+	int32_t (*next)[256];
+	int32_t* pattern; // Index of the pattern ending at each state, -1 if none
+	int32_t* output; // Nearest state down the failure links with a pattern ending, -1 if none
+	int32_t state;
+} SymAutomaton;
+
+static inline void symAutomatonFree(SymAutomaton* automaton) {
+	if (automaton) {
+		free(automaton->next);
+		free(automaton->pattern);
+		free(automaton->output);
+		free(automaton);
+	}
+}
+
+/***
+ * Returns NULL if out of memory. Patterns must not be empty. Of identical patterns,
+ * only the first is counted.
+ */
+static inline SymAutomaton* symAutomatonCreate(char* const patterns[], int numberOfPatterns) {
+	int maximumStates = 1;
+	for (int i = 0; i < numberOfPatterns; i++) {
+		maximumStates += strlen(patterns[i]);
+	}
+
+	SymAutomaton* automaton = (SymAutomaton*) calloc(1, sizeof(SymAutomaton));
+	int32_t* failure = (int32_t*) malloc(maximumStates * sizeof(int32_t));
+	int32_t* queue = (int32_t*) malloc(maximumStates * sizeof(int32_t));
+	if (!automaton || !failure || !queue || !(automaton->next = (int32_t(*)[256]) malloc(maximumStates * sizeof(*automaton->next)))
+			|| !(automaton->pattern = (int32_t*) malloc(maximumStates * sizeof(int32_t)))
+			|| !(automaton->output = (int32_t*) malloc(maximumStates * sizeof(int32_t)))) {
+		symAutomatonFree(automaton);
+		free(failure);
+		free(queue);
+		return NULL;
+	}
+
+	// The trie, -1 for no edge yet
+	memset(automaton->next[0], -1, sizeof(automaton->next[0]));
+	automaton->pattern[0] = -1;
+	automaton->numberOfStates = 1;
+	for (int i = 0; i < numberOfPatterns; i++) {
+		int32_t state = 0;
+		for (const unsigned char* c = (const unsigned char*) patterns[i]; *c; c++) {
+			if (automaton->next[state][*c] < 0) {
+				int32_t created = automaton->numberOfStates++;
+				memset(automaton->next[created], -1, sizeof(automaton->next[created]));
+				automaton->pattern[created] = -1;
+				automaton->next[state][*c] = created;
+			}
+			state = automaton->next[state][*c];
+		}
+		if (automaton->pattern[state] < 0) {
+			automaton->pattern[state] = i;
+		}
+	}
+
+	// Breadth first, so a state's failure state is done before it is
+	int head = 0, tail = 0;
+	failure[0] = 0;
+	automaton->output[0] = -1;
+	for (int c = 0; c < 256; c++) {
+		int32_t child = automaton->next[0][c];
+		if (child < 0) {
+			automaton->next[0][c] = 0;
+		}
+		else {
+			failure[child] = 0;
+			automaton->output[child] = -1;
+			queue[tail++] = child;
+		}
+	}
+	while (head < tail) {
+		int32_t state = queue[head++];
+		for (int c = 0; c < 256; c++) {
+			int32_t child = automaton->next[state][c];
+			if (child < 0) {
+				automaton->next[state][c] = automaton->next[failure[state]][c];
+			}
+			else {
+				int32_t fallback = automaton->next[failure[state]][c];
+				failure[child] = fallback;
+				automaton->output[child] = automaton->pattern[fallback] >= 0 ? fallback : automaton->output[fallback];
+				queue[tail++] = child;
+			}
+		}
+	}
+
+	free(failure);
+	free(queue);
+	return automaton;
+}
+
+/***
+ * Adds the matches ending in buffer to counts, one per pattern.
+ */
+static inline void symAutomatonScan(SymAutomaton* automaton, const char* buffer, size_t length, uint64_t* counts) {
+	int32_t state = automaton->state;
+	for (size_t i = 0; i < length; i++) {
+		state = automaton->next[state][(unsigned char) buffer[i]];
+		for (int32_t match = automaton->pattern[state] >= 0 ? state : automaton->output[state]; match >= 0;
+				match = automaton->output[match]) {
+			counts[automaton->pattern[match]]++;
+		}
+	}
+
+	automaton->state = state;
+}
+
+#endif
@@ -0,0 +1,204 @@
+#include "message_slot_core.h"
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_DEVICES 16
+#define DEFAULT_OPERATIONS 1000000 // Per thread
+#define DEFAULT_WRITE_PERCENT 50
+#define NANOSECONDS_PER_SECOND 1000000000LL
+
+/***
+ * Throughput and latency of the message slot core, in user space - every thread does
+ * its share of reads and writes, each to a random (device, channel), through the same
+ * calls the driver makes. -d 1 is everyone on one device's lock.
+ */
+
+typedef struct worker_t {
+	pthread_t thread;
+	uint64_t state; // xorshift64, seeded per thread
+	long long* latencies; // Nanoseconds, per operation
+	long long reads;
+	long long writes;
+	long long empty; // Reads of channels no one's written to yet
+} Worker;
+
+SlotDevices devices;
+int numberOfThreads = DEFAULT_THREADS;
+int numberOfDevices = DEFAULT_DEVICES;
+long long numberOfOperations = DEFAULT_OPERATIONS;
+int writePercent = DEFAULT_WRITE_PERCENT;
+int messageLength = MAXIMUM_MESSAGE_LENGTH;
+
+int copy(void* to, const void* from, unsigned long length) { // User space to user space, can't fault
+	memcpy(to, from, length);
+	return 0;
+}
+
+long long now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * NANOSECONDS_PER_SECOND + time.tv_nsec;
+}
+
+uint64_t next(Worker* worker) {
+	worker->state ^= worker->state << 13;
+	worker->state ^= worker->state >> 7;
+	worker->state ^= worker->state << 17;
+	return worker->state;
+}
+
+void* threadWorker(void* parameter) {
+	Worker* worker = (Worker*) parameter;
+	char message[MAXIMUM_MESSAGE_LENGTH], buffer[MAXIMUM_MESSAGE_LENGTH];
+	memset(message, 'm', sizeof(message));
+
+	for (long long i = 0; i < numberOfOperations; i++) {
+		uint64_t draw = next(worker);
+		unsigned int minor = (unsigned int) (draw % numberOfDevices);
+		long channel = slotIoctl(minor, MSG_SLOT_CHANNEL, (draw >> 16) % NUMBER_OF_CHANNELS);
+		long result;
+
+		long long start = now();
+		if ((int) ((draw >> 32) % 100) < writePercent) {
+			result = slotWrite(&devices, minor, channel, message, messageLength, copy);
+			worker->writes++;
+		}
+		else {
+			result = slotRead(&devices, minor, channel, buffer, sizeof(buffer), copy);
+			worker->reads++;
+			worker->empty += result == -EWOULDBLOCK;
+		}
+		worker->latencies[i] = now() - start;
+
+		if (result < 0 && result != -EWOULDBLOCK) {
+			fprintf(stderr, "message_slot_bench: Operation on %u failed: %s\n", minor, strerror((int) -result));
+			exit(1);
+		}
+	}
+
+	return NULL;
+}
+
+/***
+ * What the driver promises, checked against the core before it's timed.
+ */
+int checkSemantics() {
+	char buffer[MAXIMUM_MESSAGE_LENGTH + 1];
+	long channel = slotIoctl(0, MSG_SLOT_CHANNEL, 1);
+	return channel == 1
+			&& slotIoctl(0, MSG_SLOT_CHANNEL, NUMBER_OF_CHANNELS) == -EINVAL
+			&& slotIoctl(0, MSG_SLOT_CHANNEL + 1, 0) == -EINVAL
+			&& slotWrite(&devices, 0, NO_CHANNEL, "x", 1, copy) == -EINVAL
+			&& slotRead(&devices, 0, channel, buffer, sizeof(buffer), copy) == -EWOULDBLOCK
+			&& slotWrite(&devices, 0, channel, buffer, MAXIMUM_MESSAGE_LENGTH + 1, copy) == -EINVAL
+			&& slotWrite(&devices, numberOfDevices, channel, "x", 1, copy) == -EINVAL // Never opened
+			&& slotWrite(&devices, 0, channel, "hello", 5, copy) == 5
+			&& slotRead(&devices, 0, channel, buffer, 4, copy) == -ENOSPC
+			&& slotRead(&devices, 0, channel, buffer, sizeof(buffer), copy) == 5 && !memcmp(buffer, "hello", 5)
+			&& slotRead(&devices, 0, channel, buffer, sizeof(buffer), copy) == 5 // Messages stay until overwritten
+			&& slotRead(&devices, 0, 0, buffer, sizeof(buffer), copy) == -EWOULDBLOCK; // Other channels are their own
+}
+
+int compareLatencies(const void* a, const void* b) {
+	long long x = *(const long long*) a, y = *(const long long*) b;
+	return (x > y) - (x < y);
+}
+
+long long percentile(long long* latencies, long long count, double fraction) {
+	long long index = (long long) (fraction * count);
+	return latencies[index < count ? index : count - 1];
+}
+
+void printUsage() {
+	fprintf(stderr, "USAGE: ./message_slot_bench [-t THREADS] [-d DEVICES] [-n OPERATIONS_PER_THREAD] [-w WRITE_PERCENT] [-l MESSAGE_LENGTH]\n");
+}
+
+int main(int argc, char* argv[]) {
+	int option;
+	while ((option = getopt(argc, argv, "t:d:n:w:l:")) != -1) {
+		switch (option) {
+			case 't':
+				numberOfThreads = atoi(optarg);
+				break;
+			case 'd':
+				numberOfDevices = atoi(optarg);
+				break;
+			case 'n':
+				numberOfOperations = atoll(optarg);
+				break;
+			case 'w':
+				writePercent = atoi(optarg);
+				break;
+			case 'l':
+				messageLength = atoi(optarg);
+				break;
+			default:
+				printUsage();
+				return 1;
+		}
+	}
+	if (numberOfThreads < 1 || numberOfDevices < 1 || numberOfOperations < 1 || writePercent < 0 || writePercent > 100
+			|| messageLength < 0 || messageLength > MAXIMUM_MESSAGE_LENGTH) {
+		printUsage();
+		return 1;
+	}
+
+	slotInit(&devices);
+	for (int minor = 0; minor < numberOfDevices; minor++) { // Everyone's opened before anyone's timed
+		if (slotOpen(&devices, minor)) {
+			fprintf(stderr, "message_slot_bench: Could not open device %d\n", minor);
+			return 1;
+		}
+	}
+	if (!checkSemantics()) {
+		fprintf(stderr, "message_slot_bench: Core doesn't behave like the driver\n");
+		return 1;
+	}
+	slotDestroy(&devices); // Start over, every channel empty
+	slotInit(&devices);
+	for (int minor = 0; minor < numberOfDevices; minor++) {
+		slotOpen(&devices, minor);
+	}
+
+	Worker* workers = (Worker*) calloc(numberOfThreads, sizeof(Worker));
+	long long* latencies = (long long*) malloc(sizeof(long long) * numberOfOperations * numberOfThreads);
+	if (!workers || !latencies) {
+		fprintf(stderr, "message_slot_bench: Could not allocate memory for %d threads\n", numberOfThreads);
+		return 1;
+	}
+
+	long long start = now();
+	for (int i = 0; i < numberOfThreads; i++) {
+		workers[i].state = 88172645463325252ULL + i * 0x9E3779B97F4A7C15ULL;
+		workers[i].latencies = latencies + i * numberOfOperations;
+		if (pthread_create(&workers[i].thread, NULL, threadWorker, &workers[i])) {
+			fprintf(stderr, "message_slot_bench: Could not create %d-th thread\n", i + 1);
+			return 1;
+		}
+	}
+
+	long long reads = 0, writes = 0, empty = 0;
+	for (int i = 0; i < numberOfThreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		reads += workers[i].reads;
+		writes += workers[i].writes;
+		empty += workers[i].empty;
+	}
+	double elapsed = (double) (now() - start) / NANOSECONDS_PER_SECOND;
+
+	long long total = numberOfOperations * numberOfThreads;
+	qsort(latencies, total, sizeof(long long), compareLatencies);
+	printf("threads: %d, devices: %d, message length: %d\n", numberOfThreads, numberOfDevices, messageLength);
+	printf("operations: %lld reads (%lld empty), %lld writes in %.3f seconds\n", reads, empty, writes, elapsed);
+	printf("throughput: %.0f operations/s\n", total / elapsed);
+	printf("latency (ns): p50 %lld, p99 %lld, p999 %lld, max %lld\n", percentile(latencies, total, 0.5),
+			percentile(latencies, total, 0.99), percentile(latencies, total, 0.999), latencies[total - 1]);
+
+	slotDestroy(&devices);
+	free(latencies);
+	free(workers);
+	return 0;
+}
@@ -0,0 +1,213 @@
+#ifndef _MESSAGE_SLOT_CORE_H
+#define _MESSAGE_SLOT_CORE_H
+
+#include "message_slot.h"
+
+/***
+ * The devices and their channels, without anything that makes them a driver - so the
+ * module and user space (the throughput harness) run the very same code. All that
+ * differs is how memory's allocated, how locks lock, and how messages are copied
+ * to and from the caller, which the front end passes in.
+ *
+ * Errors are negative errnos, like the driver returns them.
+ */
+
+#define NUMBER_OF_CHANNELS 4
+#define NO_CHANNEL (-1) // What a file's channel is until ioctl sets it
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+
+#define SLOT_ALLOCATE(size) kmalloc(size, GFP_KERNEL)
+#define SLOT_FREE(pointer) kfree(pointer)
+#define SLOT_LOG(...) printk(KERN_ALERT __VA_ARGS__)
+typedef struct mutex SlotLock;
+#define SLOT_LOCK_INIT(lock) mutex_init(lock)
+#define SLOT_LOCK_DESTROY(lock) mutex_destroy(lock)
+#define SLOT_LOCK(lock) mutex_lock(lock)
+#define SLOT_UNLOCK(lock) mutex_unlock(lock)
+#else
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SLOT_ALLOCATE(size) malloc(size)
+#define SLOT_FREE(pointer) free(pointer)
+#ifdef MESSAGE_SLOT_VERBOSE
+#define SLOT_LOG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define SLOT_LOG(...) ((void) 0) // A harness hammering bad reads doesn't want a line per one
+#endif
+typedef pthread_mutex_t SlotLock;
+#define SLOT_LOCK_INIT(lock) pthread_mutex_init(lock, NULL)
+#define SLOT_LOCK_DESTROY(lock) pthread_mutex_destroy(lock)
+#define SLOT_LOCK(lock) pthread_mutex_lock(lock)
+#define SLOT_UNLOCK(lock) pthread_mutex_unlock(lock)
+#endif
+
+/***
+ * Copies length bytes, from the caller's buffer or to it. Returns 0, or nonzero if
+ * the buffer wasn't good for it.
+ */
+typedef int (*SlotCopy)(void* to, const void* from, unsigned long length);
+
+typedef struct slot_device_t {
+	char channels[NUMBER_OF_CHANNELS][MAXIMUM_MESSAGE_LENGTH];
+	int written[NUMBER_OF_CHANNELS]; // Message lengths, -1 if never written to
+	unsigned int minor;
+	SlotLock lock; // Its channels'
+	struct slot_device_t* next;
+} SlotDevice;
+
+typedef struct slot_devices_t {
+	SlotDevice* head; // Opened so far, newest last. Never shrinks until slotDestroy
+	SlotLock lock; // The list's
+} SlotDevices;
+
+static inline void slotInit(SlotDevices* devices) {
+	devices->head = NULL;
+	SLOT_LOCK_INIT(&devices->lock);
+}
+
+static inline void slotDestroy(SlotDevices* devices) {
+	SlotDevice* device = devices->head;
+	while (device) { // Clean up list nodes
+		SlotDevice* next = device->next;
+		SLOT_LOCK_DESTROY(&device->lock);
+		SLOT_FREE(device);
+		device = next;
+	}
+
+	devices->head = NULL;
+	SLOT_LOCK_DESTROY(&devices->lock);
+}
+
+/***
+ * The device with the given minor number, or NULL if it hasn't been opened. If create
+ * is set, a fresh one's added instead of returning NULL - and NULL means no memory.
+ */
+static inline SlotDevice* slotFind(SlotDevices* devices, unsigned int minor, int create) {
+	SlotDevice** link;
+	SlotDevice* device;
+
+	SLOT_LOCK(&devices->lock);
+	for (link = &devices->head; *link && (*link)->minor != minor; link = &(*link)->next) {
+	}
+	device = *link;
+	if (!device && create && (device = (SlotDevice*) SLOT_ALLOCATE(sizeof(SlotDevice)))) {
+		int i;
+		for (i = 0; i < NUMBER_OF_CHANNELS; i++) {
+			device->written[i] = -1; // Set to "not written to"
+		}
+		device->minor = minor;
+		device->next = NULL;
+		SLOT_LOCK_INIT(&device->lock);
+		*link = device;
+	}
+	SLOT_UNLOCK(&devices->lock);
+
+	return device;
+}
+
+static inline int slotOpen(SlotDevices* devices, unsigned int minor) {
+	if (!slotFind(devices, minor, 1)) { // Could not allocate
+		SLOT_LOG("message_slot: ERROR - allocating memory for %u\n", minor);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/***
+ * Checks an ioctl - the front end keeps the channel it returns with the open file.
+ */
+static inline long slotIoctl(unsigned int minor, unsigned int command, unsigned long channel) {
+	if (command != MSG_SLOT_CHANNEL) { // Blasphemy!
+		SLOT_LOG("message_slot: ERROR - illegal ioctl command passed for %u\n", minor);
+		return -EINVAL;
+	}
+
+	if (channel >= NUMBER_OF_CHANNELS) { // What is this channel you speak of?
+		SLOT_LOG("message_slot: ERROR - channel given (%lu) for %u isn't valid\n", channel, minor);
+		return -EINVAL;
+	}
+
+	return (long) channel;
+}
+
+static inline long slotRead(SlotDevices* devices, unsigned int minor, long channel, void* buffer,
+		unsigned long length, SlotCopy copyOut) {
+	SlotDevice* device;
+	int messageLength;
+
+	if (channel == NO_CHANNEL) { // No ioctl yet
+		SLOT_LOG("message_slot: ERROR - tried reading, but no channel set for %u\n", minor);
+		return -EINVAL;
+	}
+
+	if (!(device = slotFind(devices, minor, 0))) { // Minor not found
+		SLOT_LOG("message_slot: ERROR - tried reading, but %u hasn't been opened\n", minor);
+		return -EINVAL;
+	}
+
+	SLOT_LOCK(&device->lock);
+	if ((messageLength = device->written[channel]) == -1) { // Channel hadn't been written to yet
+		SLOT_UNLOCK(&device->lock);
+		SLOT_LOG("message_slot: ERROR - tried to read from %u before writing a message to it\n", minor);
+		return -EWOULDBLOCK;
+	}
+
+	if (length < (unsigned long) messageLength) { // Buffer is too small!
+		SLOT_UNLOCK(&device->lock);
+		SLOT_LOG("message_slot: ERROR - tried to read from %u, but buffer given contains %lu bytes, less than the message's length - %d bytes\n",
+				minor, length, messageLength);
+		return -ENOSPC;
+	}
+
+	if (copyOut(buffer, device->channels[channel], messageLength)) { // Oops...
+		SLOT_UNLOCK(&device->lock);
+		SLOT_LOG("message_slot: ERROR - while trying to pass message to user, for %u\n", minor);
+		return -EFAULT;
+	}
+	SLOT_UNLOCK(&device->lock);
+
+	return messageLength; // Got it!
+}
+
+static inline long slotWrite(SlotDevices* devices, unsigned int minor, long channel, const void* buffer,
+		unsigned long length, SlotCopy copyIn) {
+	SlotDevice* device;
+
+	if (channel == NO_CHANNEL) { // No channel set
+		SLOT_LOG("message_slot: ERROR - tried to write, but no channel has been set for %u\n", minor);
+		return -EINVAL;
+	}
+
+	if (length > MAXIMUM_MESSAGE_LENGTH) { // Message is too long!
+		SLOT_LOG("message_slot: ERROR - tried to write a message that contains %lu bytes, more than %d bytes to %u\n",
+				length, MAXIMUM_MESSAGE_LENGTH, minor);
+		return -EINVAL;
+	}
+
+	if (!(device = slotFind(devices, minor, 0))) { // Means minor wasn't found!
+		SLOT_LOG("message_slot: ERROR - tried to write to %u, but it wasn't opened!\n", minor);
+		return -EINVAL;
+	}
+
+	SLOT_LOCK(&device->lock);
+	if (copyIn(device->channels[channel], buffer, length)) { // Oops...
+		device->written[channel] = 0;
+		SLOT_UNLOCK(&device->lock);
+		SLOT_LOG("message_slot: ERROR - while trying to get message from user, for %u\n", minor);
+		return -EFAULT;
+	}
+	device->written[channel] = (int) length; // Update length for channel
+	SLOT_UNLOCK(&device->lock);
+
+	return (long) length;
+}
+
+#endif
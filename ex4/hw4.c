@@ -1,237 +1,1360 @@
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE and fallocate
+#include "count.h"
+#include "decode.h"
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-#define BLOCK_SIZE (1024 * 1024)
+#define DEFAULT_BLOCK_SIZE (1024 * 1024)
+#define MINIMUM_BLOCK_SIZE (64 * 1024)
+#define MAXIMUM_BLOCK_SIZE (64 * 1024 * 1024)
+#define PAGE_ALIGNMENT 4096 // Block size must be a multiple, so reads stay page aligned
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define FILE_DESCRIPTOR_SLACK 16 // stdin/out/err, output file and friends
+#define GF_POLYNOMIAL 0x11d // x^8 + x^4 + x^3 + x^2 + 1, generator 2 - same as Linux RAID-6
+#define MAXIMUM_Q_SHARDS 255 // g^i repeats after that
+#define MAXIMUM_MISSING 2
+#define NANOSECONDS_PER_SECOND 1000000000LL
+#define CRC32C_POLYNOMIAL 0x82F63B78 // Castagnoli, reflected - what SSE4.2's crc32 computes
+
+#define ROLE_DATA 0
+#define ROLE_P 1 // Parity inputs, only while reconstructing
+#define ROLE_Q 2
+#define ROLE_MISSING 3 // Not read, rebuilt
 
 int outputFileDescriptor; // So all threads can write to it
-char xoredBuffer[BLOCK_SIZE] = { 0 }; // Initialized to all 0s
-int currentBlock = 0;
+char* xoredBuffer; // Stage accumulator (P), all 0s between stages
+char* qBuffer; // Stage accumulator for the Q syndrome, if there is one
+off_t currentBlock = 0;
+int blockSize = DEFAULT_BLOCK_SIZE;
+int useHugePages = 0;
 int bytesXored = 0;
+int qBytesXored = 0;
+int done = 0;
 pthread_t* threads;
-int* threadsLeft;
+int numberOfThreads;
+int workersLeft; // Workers still busy with the current block
 pthread_mutex_t mutex;
-pthread_cond_t* conditions;
+pthread_cond_t stageCondition;
+
+char** inputFiles; // Every input, from argv and/or the manifest
+int numberOfInputFiles = 0;
+int inputFilesCapacity = 0;
+int numberOfShards; // Data inputs come first, parity inputs after them
+char* fileRoles;
+int maximumOpenFiles; // Only the first ones are kept open between blocks
+int* fileDescriptors; // -1 if not kept open
+int* activeFiles; // Files that still have data, as of the current block
+int activeCount;
+int nextTask = 0; // Index into activeFiles of the next (file, block) task
+char* fileEnded; // Set when a file came up short for the current block
+Decoder** decoders; // Compressed inputs', decoded start to end - NULL for the rest
+int* inputFormats; // DECODE_NONE, or what the file's compressed with - found when its first block's read
+int decodeThreads; // Each decoder's that decodes ahead
+int maximumDecoders; // Decoding ahead on threads of their own - the rest are decoded by the worker reading the block
+int decodersAhead = 0; // Started so far
+
+int qEnabled = 0;
+int qOutputFileDescriptor = -1;
+int reconstruct = 0;
+int missing[MAXIMUM_MISSING]; // 0 for P, otherwise a 1-based shard index
+int numberOfMissing = 0;
+int missingDescriptors[MAXIMUM_MISSING];
+char* rebuiltPaths[MAXIMUM_MISSING]; // Written to temporary files, renamed over the missing ones once it all worked
+char* rebuiltBuffers[MAXIMUM_MISSING];
+
+char* oldInputFileName = NULL; // Set for in place updates
+int oldInputFileDescriptor;
+int newInputFileDescriptor;
+int updatedShard = 0; // 1-based, for Q's coefficient
+off_t nextUpdateBlock = 0;
+off_t updateBlocks;
+
+char* checksumFileName = NULL; // CRC32C of every input and output, taken on the way through
+uint32_t* inputChecksums; // Each file's is only touched by the worker reading its block, a stage at a time
+uint32_t outputChecksums[MAXIMUM_MISSING]; // Output and Q, or the rebuilt files
+uint32_t crc32cTable[256];
+uint32_t (*crc32c)(uint32_t crc, const char* data, int length);
+
+typedef struct worker_stats_t { // Written only by its worker, read by the progress reporter
+	long long bytesRead;
+	long long tasks;
+	long long ioNanoseconds; // Reading inputs
+	long long computeNanoseconds; // XOR and Q
+	long long mutexNanoseconds; // Waiting for the mutex
+	long long conditionNanoseconds; // Waiting for the rest of the block's workers
+	long long writeNanoseconds; // Writing (and rebuilding) outputs, when last
+} __attribute__((aligned(64))) WorkerStats; // A cache line each, no false sharing
+
+#define STAT_ADD(field, value) __atomic_store_n(&(field), (field) + (value), __ATOMIC_RELAXED)
+#define STAT_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+WorkerStats* workerStats;
+long long blocksWritten = 0;
+long long bytesWritten = 0;
+long long startTime;
+int progressInterval = 0; // Seconds between progress lines, 0 for none
+char* statsFileName = NULL; // JSON stats at exit
+int workersRunning;
+pthread_mutex_t progressMutex;
+pthread_cond_t progressCondition;
+
+unsigned char gfExp[512]; // Doubled, so gfExp[a + b] needs no modulo
+unsigned char gfLog[256];
+void (*gfMultiplyXor)(char* destination, const char* source, int length, unsigned char coefficient);
+
+void gfInit() {
+	int x = 1;
+	for (int i = 0; i < 255; i++) {
+		gfExp[i] = gfExp[i + 255] = x;
+		gfLog[x] = i;
+		x <<= 1;
+		if (x & 0x100) {
+			x ^= GF_POLYNOMIAL;
+		}
+	}
+	gfExp[510] = gfExp[0];
+}
+
+unsigned char gfMultiply(unsigned char a, unsigned char b) {
+	return a && b ? gfExp[gfLog[a] + gfLog[b]] : 0;
+}
+
+unsigned char gfInverse(unsigned char a) {
+	return gfExp[255 - gfLog[a]];
+}
+
+// destination ^= coefficient * source, one table lookup per byte
+void gfMultiplyXorTable(char* destination, const char* source, int length, unsigned char coefficient) {
+	if (coefficient == 1) { // Plain old XOR
+		countXor(destination, source, length);
+		return;
+	}
+
+	unsigned char row[256];
+	for (int i = 0; i < 256; i++) {
+		row[i] = gfMultiply(coefficient, i);
+	}
+	for (int i = 0; i < length; i++) {
+		destination[i] ^= row[(unsigned char) source[i]];
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Same, 16 bytes at a time - split each byte into nibbles and look both up with a shuffle
+__attribute__((target("ssse3")))
+void gfMultiplyXorShuffle(char* destination, const char* source, int length, unsigned char coefficient) {
+	if (coefficient == 1) { // Multiplying by 1 is a waste of shuffles
+		countXor(destination, source, length);
+		return;
+	}
+
+	unsigned char low[16], high[16];
+	for (int i = 0; i < 16; i++) {
+		low[i] = gfMultiply(coefficient, i);
+		high[i] = gfMultiply(coefficient, i << 4);
+	}
+
+	__m128i lowTable = _mm_loadu_si128((__m128i*) low);
+	__m128i highTable = _mm_loadu_si128((__m128i*) high);
+	__m128i mask = _mm_set1_epi8(0x0f);
+	int i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i in = _mm_loadu_si128((__m128i*) (source + i));
+		__m128i product = _mm_xor_si128(_mm_shuffle_epi8(lowTable, _mm_and_si128(in, mask)),
+				_mm_shuffle_epi8(highTable, _mm_and_si128(_mm_srli_epi64(in, 4), mask)));
+		__m128i out = _mm_loadu_si128((__m128i*) (destination + i));
+		_mm_storeu_si128((__m128i*) (destination + i), _mm_xor_si128(out, product));
+	}
+
+	gfMultiplyXorTable(destination + i, source + i, length - i, coefficient); // Leftovers
+}
+#endif
+
+void crc32cInit() {
+	for (int i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+		}
+		crc32cTable[i] = crc;
+	}
+}
+
+// Continues crc over data - start from 0, and a file's blocks can be fed one at a time, in order
+uint32_t crc32cTableDriven(uint32_t crc, const char* data, int length) {
+	crc = ~crc;
+	for (int i = 0; i < length; i++) {
+		crc = crc32cTable[(crc ^ (unsigned char) data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+// Same, 8 bytes per instruction
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const char* data, int length) {
+	uint64_t state = ~crc, word;
+	int i = 0;
+	for (; i + 8 <= length; i += 8) {
+		memcpy(&word, data + i, 8);
+		state = _mm_crc32_u64(state, word);
+	}
+	for (; i < length; i++) { // Leftovers
+		state = _mm_crc32_u8((uint32_t) state, (unsigned char) data[i]);
+	}
+	return ~(uint32_t) state;
+}
+#endif
 
-void cleanUp(int maximumFileBlocks) { // Free memory and destroy mutexes and condition variables
+// Pads the accumulator with 0s up to bytes - all a block of 0s (a hole) has to do
+void growAccumulator(char* accumulator, int* accumulatedBytes, int bytes) {
+	if (bytes > *accumulatedBytes) {
+		memset(accumulator + *accumulatedBytes, 0, bytes - *accumulatedBytes);
+		*accumulatedBytes = bytes;
+	}
+}
+
+// accumulator ^= coefficient * data, growing the accumulator (with 0s) if data is longer
+void accumulate(char* accumulator, int* accumulatedBytes, const char* data, int bytes, unsigned char coefficient) {
+	growAccumulator(accumulator, accumulatedBytes, bytes);
+	gfMultiplyXor(accumulator, data, bytes, coefficient);
+}
+
+int isZero(const char* buffer, int bytes) { // Each byte equals the one before it, and the first is 0
+	return !bytes || (!buffer[0] && !memcmp(buffer, buffer + 1, bytes - 1));
+}
+
+long long now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * NANOSECONDS_PER_SECOND + time.tv_nsec;
+}
+
+void lockMutex(WorkerStats* stats) {
+	long long start = now();
+	if (pthread_mutex_lock(&mutex)) {
+		printf("ERROR: Could not (even try) to lock mutex.\n");
+		exit(1);
+	}
+	STAT_ADD(stats->mutexNanoseconds, now() - start);
+}
+
+size_t bufferLength() { // Rounded up, so huge pages aren't split with anyone
+	size_t alignment = useHugePages ? HUGE_PAGE_SIZE : PAGE_ALIGNMENT;
+	return (blockSize + alignment - 1) / alignment * alignment;
+}
+
+/***
+ * Page aligned, zeroed, and placed on the NUMA node of whichever thread touches it
+ * first - so workers allocate (and touch) their own buffers.
+ */
+char* allocateBuffer() {
+	void* buffer = MAP_FAILED;
+	if (useHugePages) { // Explicit huge pages if there are any reserved, transparent ones otherwise
+		buffer = mmap(NULL, bufferLength(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+	if (buffer == MAP_FAILED) {
+		buffer = mmap(NULL, bufferLength(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buffer == MAP_FAILED) {
+			printf("ERROR: Could not allocate %d bytes for block buffer.\n", blockSize);
+			exit(1);
+		}
+		if (useHugePages) {
+			madvise(buffer, bufferLength(), MADV_HUGEPAGE); // Just a hint
+		}
+	}
+
+	memset(buffer, 0, blockSize); // First touch
+	return (char*) buffer;
+}
+
+void freeBuffer(char* buffer) {
+	if (buffer) {
+		munmap(buffer, bufferLength());
+	}
+}
+
+int parseBlockSize(const char* size) { // Bytes, or with a K/M suffix
+	char* end;
+	long value = strtol(size, &end, 10);
+	switch (toupper(*end)) {
+		case 'K':
+			value *= 1024;
+			end++;
+			break;
+		case 'M':
+			value *= 1024 * 1024;
+			end++;
+			break;
+	}
+
+	if (*end || value < MINIMUM_BLOCK_SIZE || value > MAXIMUM_BLOCK_SIZE || value % PAGE_ALIGNMENT) {
+		printf("ERROR: Block size must be a multiple of %d between 64K and 64M.\n", PAGE_ALIGNMENT);
+		exit(1);
+	}
+	return (int) value;
+}
+
+void cleanUp() { // Free memory and destroy mutexes and condition variables
 	free(threads);
-	free(threadsLeft);
-	for (int i = 0; i < maximumFileBlocks; i++) {
-		pthread_cond_destroy(&conditions[i]);
+	free(workerStats);
+	freeBuffer(xoredBuffer);
+	freeBuffer(qBuffer);
+	for (int i = 0; i < numberOfMissing; i++) {
+		freeBuffer(rebuiltBuffers[i]);
+	}
+	free(fileDescriptors);
+	free(activeFiles);
+	free(fileEnded);
+	free(decoders);
+	free(inputFormats);
+	free(inputChecksums);
+	free(fileRoles);
+	for (int i = 0; i < numberOfInputFiles; i++) {
+		free(inputFiles[i]);
 	}
+	free(inputFiles);
+	pthread_cond_destroy(&stageCondition);
 	pthread_mutex_destroy(&mutex);
-	free(conditions);
+	pthread_cond_destroy(&progressCondition);
+	pthread_mutex_destroy(&progressMutex);
+}
+
+void addInputFile(const char* path) {
+	if (numberOfInputFiles == inputFilesCapacity) { // Out of room, double it
+		inputFilesCapacity = inputFilesCapacity ? inputFilesCapacity * 2 : 64;
+		inputFiles = (char**) realloc(inputFiles, sizeof(char*) * inputFilesCapacity);
+		if (!inputFiles) {
+			printf("ERROR: Could not allocate memory for input file list.\n");
+			exit(1);
+		}
+	}
+
+	if (!(inputFiles[numberOfInputFiles++] = strdup(path))) {
+		printf("ERROR: Could not allocate memory for input file list.\n");
+		exit(1);
+	}
 }
 
-void* threadFileReader(void* thread_param) {
-	if (!thread_param) { // Safety
+void readManifest(const char* manifest) { // One path per line, "-" for stdin
+	FILE* stream = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+	if (!stream) {
+		printf("ERROR: Could not open manifest %s.\n", manifest);
 		exit(1);
 	}
 
-	char* inputFile = (char*) thread_param;
-	int inputFileDescriptor = open(inputFile, O_RDONLY); // Open file for read
+	char* line = NULL;
+	size_t lineCapacity = 0;
+	ssize_t lineLength;
+	while ((lineLength = getline(&line, &lineCapacity, stream)) != -1) {
+		while (lineLength > 0 && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r')) {
+			line[--lineLength] = '\0'; // Chomp
+		}
+		if (lineLength) { // Skip blank lines
+			addInputFile(line);
+		}
+	}
+
+	free(line);
+	if (stream != stdin) {
+		fclose(stream);
+	}
+}
+
+int isSeekable(int fileDescriptor) {
+	return lseek(fileDescriptor, 0, SEEK_CUR) >= 0 || errno != ESPIPE;
+}
+
+int openInputFile(int file, off_t block) { // Kept open if it fits under the limit, otherwise opened per task
+	if (fileDescriptors[file] != -1) {
+		return fileDescriptors[file];
+	}
+
+	int inputFileDescriptor = open(inputFiles[file], O_RDONLY);
 	if (inputFileDescriptor == -1) {
-		printf("ERROR: Could not open %s.\n", inputFile);
+		printf("ERROR: Could not open %s.\n", inputFiles[file]);
 		exit(1);
 	}
+	if (decoders[file]) { // Compressed, and over the limit - its decoder reads on from where it got to
+		decodeAttach(decoders[file], inputFileDescriptor);
+		return inputFileDescriptor;
+	}
 
-	char buffer[BLOCK_SIZE];
-	int readBytes;
-	int writtenBytes;
-	int block = 0;
-	// As long as there's still something to read
-	// (0 inclusive, to let others know the thread's finished)
-	while ((readBytes = read(inputFileDescriptor, buffer, BLOCK_SIZE)) >= 0) {
-		block++; // Read one more block
-		if (pthread_mutex_lock(&mutex)) { // Lock for xoring
-			printf("ERROR: Could not (even try) to lock mutex for %s's thread.\n", inputFile);
+	int format = block ? DECODE_NONE : (inputFormats[file] = decodeFormat(inputFileDescriptor));
+	if (format != DECODE_NONE) { // Decoding ahead takes threads, chunks and the descriptor - only so many get to
+		int ahead = file < maximumOpenFiles && __atomic_fetch_add(&decodersAhead, 1, __ATOMIC_RELAXED) < maximumDecoders;
+		if (!(decoders[file] = decodeStart(inputFileDescriptor, format, ahead ? decodeThreads : 0))) {
+			printf("ERROR: Could not start decoding %s (%s): %s.\n", inputFiles[file], decodeFormatName(format), strerror(errno));
 			exit(1);
 		}
-		threadsLeft[block - 1]--; // Shared, counter of running threads
-		for (int i = 0; i < readBytes; i++) {
-			xoredBuffer[i] ^= buffer[i]; // XOR
+	}
+
+	if (file < maximumOpenFiles || !isSeekable(inputFileDescriptor)) { // A pipe can't be reopened where it left off
+		posix_fadvise(inputFileDescriptor, 0, 0, POSIX_FADV_SEQUENTIAL); // Just a hint
+		fileDescriptors[file] = inputFileDescriptor;
+	}
+	return inputFileDescriptor;
+}
+
+void closeInputFile(int file, int inputFileDescriptor, int ended) {
+	if (fileDescriptors[file] == inputFileDescriptor && !ended) {
+		return; // Keep it for the next block
+	}
+
+	if (decoders[file] && !ended) { // Over the limit - lets go of the file, but not of where it got to
+		if (decodeDetach(decoders[file])) {
+			printf("ERROR: Could not close %s.\n", inputFiles[file]);
+			exit(1);
 		}
+		return;
+	}
+
+	if (decoders[file]) { // Closes it, too
+		decodeFinish(decoders[file]);
+		decoders[file] = NULL;
+		fileDescriptors[file] = -1;
+		return;
+	}
 
-		if (readBytes > bytesXored) {
-			bytesXored = readBytes; // How many were XOR-ed
+	if (close(inputFileDescriptor)) {
+		printf("ERROR: Could not close %s.\n", inputFiles[file]);
+		exit(1);
+	}
+	fileDescriptors[file] = -1;
+}
+
+int createOutputFile(const char* path) {
+	// creat(...) === open(O_WRONLY|O_CREAT|O_TRUNC,...)
+	int fileDescriptor = creat(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (fileDescriptor == -1) { // Could not creat
+		printf("ERROR: Could not open output file %s.\n", path);
+		exit(1);
+	}
+	return fileDescriptor;
+}
+
+int readBlock(int inputFileDescriptor, char* buffer, off_t block) { // Full block, unless the file ends
+	int readBytes = 0;
+	ssize_t ret;
+	while (readBytes < blockSize) {
+		ret = pread(inputFileDescriptor, buffer + readBytes, blockSize - readBytes, block * blockSize + readBytes);
+		if (ret < 0 && errno == ESPIPE) { // Pipes and FIFOs - kept open, and their blocks come in order
+			ret = read(inputFileDescriptor, buffer + readBytes, blockSize - readBytes);
 		}
-		// Other threads are waiting to start the same block in their files
-		if (threadsLeft[block - 1]) {
-			if (pthread_cond_signal(&conditions[block - 1])) { // Get them ready
-				printf("ERROR: Could not signal condition variable for %d-th block.\n", block);
-				exit(1);
+		if (ret <= 0) {
+			if (ret == 0) { // End of file
+				break;
 			}
+			return -1;
+		}
+		readBytes += ret;
+	}
 
-			if (!readBytes) { // Not sticking around
-				if (pthread_mutex_unlock(&mutex)) { // Let them race
-					printf("ERROR: Could not unlock mutex by %s's thread.\n", inputFile);
-					exit(1);
-				}
-				if (close(inputFileDescriptor)) { // Close file
-					printf("ERROR: Could not close %s.\n", inputFile);
-					exit(1);
-				}
+	return readBytes;
+}
 
-				pthread_exit(NULL); // All done!
-			}
+/***
+ * Same, but only the file's data is read - holes are zeroed in the buffer instead. If
+ * the whole block is a hole, *hole is set and the buffer isn't touched at all. Files
+ * (or filesystems) that can't tell where their holes are are just read.
+ */
+int readDataBlock(int inputFileDescriptor, char* buffer, off_t block, int* hole) {
+	off_t start = block * blockSize;
+	off_t data = lseek(inputFileDescriptor, start, SEEK_DATA);
+	*hole = 0;
+	if (data < 0 && errno != ENXIO) { // ENXIO is nothing but hole (or EOF) from here on
+		return readBlock(inputFileDescriptor, buffer, block);
+	}
 
-			threadsLeft[block]++; // Still here for next stage
+	struct stat st;
+	if (fstat(inputFileDescriptor, &st)) {
+		return -1;
+	}
+	off_t end = st.st_size < start + blockSize ? st.st_size : start + blockSize;
+	if (end <= start) {
+		return 0;
+	}
+	if (data < 0 || data >= end) {
+		*hole = 1;
+		return end - start;
+	}
 
-			while (currentBlock != block) { // In case we wake up early
-				if (pthread_cond_wait(&conditions[block], &mutex)) { // Just keep on waiting... *Waiting...*
-					printf("ERROR: Could not wait on condition variable for %d-th block.\n", block + 1);
-					exit(1);
-				}
+	for (off_t offset = start; offset < end; ) {
+		if (data < 0 || data > end) {
+			data = end;
+		}
+		memset(buffer + (offset - start), 0, data - offset); // Hole
+		if (data == end) {
+			break;
+		}
+
+		off_t dataEnd = lseek(inputFileDescriptor, data, SEEK_HOLE);
+		if (dataEnd < 0 || dataEnd > end) {
+			dataEnd = end;
+		}
+		while (data < dataEnd) {
+			ssize_t ret = pread(inputFileDescriptor, buffer + (data - start), dataEnd - data, data);
+			if (ret <= 0) {
+				return ret ? -1 : data - start; // Shrunk under us - it ends here, then
 			}
+			data += ret;
+		}
+
+		offset = dataEnd;
+		data = offset < end ? lseek(inputFileDescriptor, offset, SEEK_DATA) : end;
+	}
+
+	return end - start;
+}
+
+void writeBlockAt(int fileDescriptor, const char* buffer, int bytes, off_t block) {
+	int writtenBytes = 0;
+	ssize_t ret;
+	while (writtenBytes < bytes) {
+		ret = pwrite(fileDescriptor, buffer + writtenBytes, bytes - writtenBytes, block * blockSize + writtenBytes);
+		if (ret < 0) {
+			printf("ERROR: Could not write whole buffer for %ld-th block.\n", (long) block + 1);
+			exit(1);
+		}
+		writtenBytes += ret;
+	}
+}
+
+// Sequentially - a block of 0s is skipped over, leaving a hole, where the file can have one
+void writeBlock(int fileDescriptor, const char* buffer, int bytes, off_t block) {
+	if (bytes && isZero(buffer, bytes) && lseek(fileDescriptor, bytes, SEEK_CUR) >= 0) {
+		return;
+	}
+	if (write(fileDescriptor, buffer, bytes) < bytes) { // Oopsie
+		printf("ERROR: Could not write whole buffer for %ld-th block.\n", (long) block + 1);
+		exit(1);
+	}
+}
+
+/***
+ * Solves for the missing blocks, given everything that survived XOR-ed into P
+ * and everything that survived multiplied into Q. Shard i's coefficient is g^(i - 1).
+ */
+void rebuildBlock(int bytes, off_t block) {
+	for (int i = 0; i < numberOfMissing; i++) {
+		memset(rebuiltBuffers[i], 0, bytes);
+	}
+
+	if (numberOfMissing == 1) { // P is enough
+		memcpy(rebuiltBuffers[0], xoredBuffer, bytes);
+	}
+	else if (!missing[0]) { // Lost P too, so it's all on Q: D_x = g^-x * Q
+		gfMultiplyXor(rebuiltBuffers[1], qBuffer, bytes, gfInverse(gfExp[missing[1] - 1]));
+		memcpy(rebuiltBuffers[0], xoredBuffer, bytes); // And P is the rest of them plus D_x
+		gfMultiplyXor(rebuiltBuffers[0], rebuiltBuffers[1], bytes, 1);
+	}
+	else { // P = D_x + D_y, Q = g^x * D_x + g^y * D_y
+		unsigned char gx = gfExp[missing[0] - 1], gy = gfExp[missing[1] - 1];
+		unsigned char denominator = gfInverse(gx ^ gy);
+		gfMultiplyXor(rebuiltBuffers[0], xoredBuffer, bytes, gfMultiply(gy, denominator));
+		gfMultiplyXor(rebuiltBuffers[0], qBuffer, bytes, denominator);
+		memcpy(rebuiltBuffers[1], xoredBuffer, bytes);
+		gfMultiplyXor(rebuiltBuffers[1], rebuiltBuffers[0], bytes, 1);
+	}
+
+	for (int i = 0; i < numberOfMissing; i++) {
+		if (checksumFileName) {
+			outputChecksums[i] = crc32c(outputChecksums[i], rebuiltBuffers[i], bytes);
 		}
-		else { // Last thread to run this block - it's XOR-ing time!
-			if ((writtenBytes = write(outputFileDescriptor, xoredBuffer, bytesXored)) < bytesXored) { // Oopsie
-				printf("ERROR: Could not write whole buffer for %d-th block.\n", block);
+		writeBlock(missingDescriptors[i], rebuiltBuffers[i], bytes, block);
+	}
+}
+
+void workerFinished() {
+	pthread_mutex_lock(&progressMutex); // Let the progress reporter know
+	workersRunning--;
+	pthread_cond_signal(&progressCondition);
+	pthread_mutex_unlock(&progressMutex);
+}
+
+void* threadWorker(void* thread_param) {
+	WorkerStats* stats = (WorkerStats*) thread_param;
+	long long start;
+	char* buffer = allocateBuffer();
+	char* accumulator = allocateBuffer(); // Private P of this worker's tasks
+	char* qAccumulator = qEnabled ? allocateBuffer() : NULL; // And private Q
+
+	lockMutex(stats);
+
+	while (!done) {
+		off_t block = currentBlock;
+		int accumulatedBytes = 0;
+		int qAccumulatedBytes = 0;
+
+		while (nextTask < activeCount) { // Grab (file, block) tasks until there are none left
+			int file = activeFiles[nextTask++];
+			if (pthread_mutex_unlock(&mutex)) { // Read and XOR outside the lock
+				printf("ERROR: Could not unlock mutex.\n");
 				exit(1);
 			}
 
-			// Clean up for next block
-			bytesXored = 0;
-			for (int i = 0; i < BLOCK_SIZE; i++) {
-				xoredBuffer[i] = 0;
-			}
-			currentBlock++;
-			if (pthread_cond_signal(&conditions[block])) { // Get ready
-				printf("ERROR: Could not signal condition variable for %d-th block.\n", block);
+			start = now();
+			int inputFileDescriptor = openInputFile(file, block);
+			int hole = 0;
+			int readBytes = decoders[file] ? (int) decodeRead(decoders[file], buffer, blockSize) // Blocks of a file come in order
+					: readDataBlock(inputFileDescriptor, buffer, block, &hole);
+			if (readBytes < 0) {
+				printf("ERROR: Could not read %ld-th block of %s.\n", (long) block + 1, inputFiles[file]);
+				exit(1);
 			}
+			STAT_ADD(stats->ioNanoseconds, now() - start);
+			STAT_ADD(stats->bytesRead, readBytes);
+			STAT_ADD(stats->tasks, 1);
 
-			if (!readBytes) { // But I'm done
-				if (pthread_mutex_unlock(&mutex)) { // GO!
-					printf("ERROR: Could not unlock mutex by %s's thread.\n", inputFile);
-					exit(1);
+			start = now();
+
+			if (hole && checksumFileName) { // It's 0s as far as the checksum's concerned
+				memset(buffer, 0, readBytes);
+			}
+			if (checksumFileName) { // While it's still in cache
+				inputChecksums[file] = crc32c(inputChecksums[file], buffer, readBytes);
+			}
+			if (hole) { // XOR-ing 0s changes nothing, but the block's still this long
+				growAccumulator(fileRoles[file] == ROLE_Q ? qAccumulator : accumulator,
+						fileRoles[file] == ROLE_Q ? &qAccumulatedBytes : &accumulatedBytes, readBytes);
+				if (fileRoles[file] == ROLE_DATA && qEnabled) {
+					growAccumulator(qAccumulator, &qAccumulatedBytes, readBytes);
 				}
-				if (close(inputFileDescriptor)) {
-					printf("ERROR: Could not close %s.\n", inputFile);
-					exit(1);
+			}
+			else if (fileRoles[file] == ROLE_Q) {
+				accumulate(qAccumulator, &qAccumulatedBytes, buffer, readBytes, 1);
+			}
+			else {
+				accumulate(accumulator, &accumulatedBytes, buffer, readBytes, 1); // XOR
+				if (fileRoles[file] == ROLE_DATA && qEnabled) {
+					accumulate(qAccumulator, &qAccumulatedBytes, buffer, readBytes, gfExp[file]);
 				}
-				pthread_exit(NULL); // Bye bye :)
 			}
 
-			threadsLeft[block]++; // Still here
+			STAT_ADD(stats->computeNanoseconds, now() - start);
 
-			while (currentBlock != block) { // Wait my turn
-				if (pthread_cond_wait(&conditions[block], &mutex)) { // Waiting on the world to change...
-					printf("ERROR: Could not wait on condition variable for %d-th block.\n", block + 1);
+			closeInputFile(file, inputFileDescriptor, readBytes < blockSize);
+
+			lockMutex(stats);
+			if (readBytes < blockSize) { // Short read - this file's done after this block
+				fileEnded[file] = 1;
+			}
+		}
+
+		// Out of tasks for this block, hand in what we've got
+		start = now();
+		gfMultiplyXor(xoredBuffer, accumulator, accumulatedBytes, 1);
+		if (accumulatedBytes > bytesXored) {
+			bytesXored = accumulatedBytes; // How many were XOR-ed
+		}
+		if (qEnabled) {
+			gfMultiplyXor(qBuffer, qAccumulator, qAccumulatedBytes, 1);
+			if (qAccumulatedBytes > qBytesXored) {
+				qBytesXored = qAccumulatedBytes;
+			}
+		}
+		STAT_ADD(stats->computeNanoseconds, now() - start);
+
+		if (--workersLeft) { // Others are still reading this block
+			start = now();
+			while (currentBlock == block && !done) { // In case we wake up early
+				if (pthread_cond_wait(&stageCondition, &mutex)) {
+					printf("ERROR: Could not wait on condition variable for %ld-th block.\n", (long) block + 2);
 					exit(1);
 				}
 			}
+			STAT_ADD(stats->conditionNanoseconds, now() - start);
+			continue;
+		}
+
+		// Last worker to finish this block - it's writing time!
+		start = now();
+		int bytes = bytesXored > qBytesXored ? bytesXored : qBytesXored;
+		if (reconstruct) {
+			rebuildBlock(bytes, block);
+		}
+		else {
+			if (checksumFileName) {
+				outputChecksums[0] = crc32c(outputChecksums[0], xoredBuffer, bytesXored);
+				if (qEnabled) {
+					outputChecksums[1] = crc32c(outputChecksums[1], qBuffer, qBytesXored);
+				}
+			}
+			writeBlock(outputFileDescriptor, xoredBuffer, bytesXored, block);
+			if (qEnabled) {
+				writeBlock(qOutputFileDescriptor, qBuffer, qBytesXored, block);
+			}
 		}
+		STAT_ADD(stats->writeNanoseconds, now() - start);
+		STAT_ADD(blocksWritten, 1);
+		STAT_ADD(bytesWritten, bytes);
 
-		if (pthread_mutex_unlock(&mutex)) { // Done, thank you :)
-			printf("ERROR: Could not unlock mutex by %s's thread.\n", inputFile);
+		int stillActive = 0; // Drop the files that ended
+		for (int i = 0; i < activeCount; i++) {
+			if (!fileEnded[activeFiles[i]]) {
+				activeFiles[stillActive++] = activeFiles[i];
+			}
+		}
+		activeCount = stillActive;
+
+		// Clean up for next block
+		memset(xoredBuffer, 0, bytesXored);
+		if (qEnabled) {
+			memset(qBuffer, 0, qBytesXored);
+		}
+		bytesXored = 0;
+		qBytesXored = 0;
+		nextTask = 0;
+		workersLeft = numberOfThreads;
+		done = !activeCount;
+		currentBlock++;
+		if (pthread_cond_broadcast(&stageCondition)) { // Everybody up
+			printf("ERROR: Could not signal condition variable for %ld-th block.\n", (long) block + 2);
 			exit(1);
 		}
 	}
 
-	// If we got here, an error occurred while reading
-	printf("ERROR: Could not read %d-th block of %s.\n", block + 1, inputFile);
-	exit(1);
-}
-
-int main(int argc, char* argv[]) {
-	if (argc < 3) { // Can you repeat that?
-		printf("USAGE: ./hw4 <OUTPUT_FILE_PATH> <INPUT_FILE_PATH> [...]\n");
+	if (pthread_mutex_unlock(&mutex)) { // Done, thank you :)
+		printf("ERROR: Could not unlock mutex.\n");
 		exit(1);
 	}
 
-	int numberOfInputFiles = argc - 2;
-	char* outputFileName = argv[1];
-	printf("Hello, creating %s from %d input files\n", outputFileName, numberOfInputFiles);
+	freeBuffer(buffer);
+	freeBuffer(accumulator);
+	freeBuffer(qAccumulator);
 
-	// creat(...) === open(O_WRONLY|O_CREAT|O_TRUNC,...)
-	outputFileDescriptor = creat(argv[1], S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-	if (outputFileDescriptor == -1) { // Could not creat
-		printf("ERROR: Could not open output file.\n");
+	workerFinished();
+	return NULL;
+}
+
+/***
+ * output ^= coefficient * delta, in place, for one block. The output is never
+ * shortened, only grown when the new input is longer than it.
+ */
+void updateBlock(int fileDescriptor, char* outputBuffer, const char* delta, int bytes, off_t block, unsigned char coefficient) {
+	int hole;
+	int outputBytes = readDataBlock(fileDescriptor, outputBuffer, block, &hole);
+	if (outputBytes < 0) {
+		printf("ERROR: Could not read %ld-th block of output.\n", (long) block + 1);
 		exit(1);
 	}
+	if (hole) {
+		memset(outputBuffer, 0, outputBytes);
+	}
+	int oldOutputBytes = outputBytes;
+	if (bytes > outputBytes) { // Past the end of the old output, XOR with 0s
+		memset(outputBuffer + outputBytes, 0, bytes - outputBytes);
+		outputBytes = bytes;
+	}
 
-	// So we can join them later
-	threads = (pthread_t*) malloc(sizeof(pthread_t) * numberOfInputFiles);
-	if (!threads) {
-		printf("ERROR: Could not allocate memory for thread management.\n");
+	gfMultiplyXor(outputBuffer, delta, bytes, coefficient);
+	if (outputBytes == oldOutputBytes && isZero(outputBuffer, outputBytes) && !fallocate(fileDescriptor,
+			FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, block * blockSize, outputBytes)) {
+		return; // Came out all 0s, so give the space back
 	}
+	writeBlockAt(fileDescriptor, outputBuffer, outputBytes, block);
+}
 
-	struct stat st;
-	int fileBlocks;
-	int maximumFileBlocks = 0;
-	for (int i = 0; i < numberOfInputFiles; i++) {
-		if (stat(argv[i + 2], &st)) { // For file size...
-			printf("ERROR: Could not calculate %d-th file size.\n", i + 1);
+/***
+ * In place update: since XOR is its own inverse, output ^= old ^ new for every
+ * block whose contents differ. Blocks are independent, so workers just take the next one.
+ */
+void* threadUpdater(void* thread_param) {
+	WorkerStats* stats = (WorkerStats*) thread_param;
+	long long start;
+	char* oldBuffer = allocateBuffer();
+	char* newBuffer = allocateBuffer();
+	char* outputBuffer = allocateBuffer();
+	off_t block;
+
+	while ((block = __atomic_fetch_add(&nextUpdateBlock, 1, __ATOMIC_RELAXED)) < updateBlocks) {
+		start = now();
+		int oldHole, newHole;
+		int oldBytes = readDataBlock(oldInputFileDescriptor, oldBuffer, block, &oldHole);
+		int newBytes = readDataBlock(newInputFileDescriptor, newBuffer, block, &newHole);
+		if (oldBytes < 0 || newBytes < 0) {
+			printf("ERROR: Could not read %ld-th block of %s.\n", (long) block + 1, oldBytes < 0 ? oldInputFileName : inputFiles[0]);
 			exit(1);
 		}
+		STAT_ADD(stats->ioNanoseconds, now() - start);
+		STAT_ADD(stats->bytesRead, oldBytes + newBytes);
+		STAT_ADD(stats->tasks, 1);
+		if (oldHole && newHole) { // 0s before and after
+			continue;
+		}
 
-		fileBlocks = st.st_size / BLOCK_SIZE;
-		if (fileBlocks > maximumFileBlocks) {
-			maximumFileBlocks = fileBlocks; // So we can know how many blocks will be
+		start = now();
+		int bytes = oldBytes > newBytes ? oldBytes : newBytes; // Shorter one is 0s past its end
+		memset(oldBuffer, 0, oldHole ? oldBytes : 0);
+		memset(newBuffer, 0, newHole ? newBytes : 0);
+		memset(oldBuffer + oldBytes, 0, bytes - oldBytes);
+		memset(newBuffer + newBytes, 0, bytes - newBytes);
+		if (!memcmp(oldBuffer, newBuffer, bytes)) { // Unchanged, nothing to do
+			STAT_ADD(stats->computeNanoseconds, now() - start);
+			continue;
 		}
+		gfMultiplyXor(oldBuffer, newBuffer, bytes, 1); // Old buffer is now the delta
+		STAT_ADD(stats->computeNanoseconds, now() - start);
+
+		start = now();
+		updateBlock(outputFileDescriptor, outputBuffer, oldBuffer, bytes, block, 1);
+		if (qEnabled) {
+			updateBlock(qOutputFileDescriptor, outputBuffer, oldBuffer, bytes, block, gfExp[updatedShard - 1]);
+		}
+		STAT_ADD(stats->writeNanoseconds, now() - start);
+		__atomic_fetch_add(&blocksWritten, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&bytesWritten, bytes, __ATOMIC_RELAXED);
 	}
 
-	// Counters, to keep track of how many threads are waiting on each stage
-	threadsLeft = (int*) calloc(sizeof(int) * (maximumFileBlocks + 1), sizeof(int));
-	if (!threads) {
-		printf("ERROR: Could not allocate memory for stage management.\n");
+	freeBuffer(oldBuffer);
+	freeBuffer(newBuffer);
+	freeBuffer(outputBuffer);
+
+	workerFinished();
+	return NULL;
+}
+
+WorkerStats totalStats() { // Sum of all workers, as of right about now
+	WorkerStats total = { 0 };
+	for (int i = 0; i < numberOfThreads; i++) {
+		total.bytesRead += STAT_LOAD(workerStats[i].bytesRead);
+		total.tasks += STAT_LOAD(workerStats[i].tasks);
+		total.ioNanoseconds += STAT_LOAD(workerStats[i].ioNanoseconds);
+		total.computeNanoseconds += STAT_LOAD(workerStats[i].computeNanoseconds);
+		total.mutexNanoseconds += STAT_LOAD(workerStats[i].mutexNanoseconds);
+		total.conditionNanoseconds += STAT_LOAD(workerStats[i].conditionNanoseconds);
+		total.writeNanoseconds += STAT_LOAD(workerStats[i].writeNanoseconds);
+	}
+	return total;
+}
+
+/***
+ * Prints a progress line to stderr every progressInterval seconds until all workers
+ * are done. Rates are over the last interval, time split is where the workers spent it.
+ */
+void reportProgress() {
+	long long previousTime = startTime, previousBytes = 0, previousBlocks = 0;
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+
+	pthread_mutex_lock(&progressMutex);
+	while (workersRunning) {
+		deadline.tv_sec += progressInterval;
+		if (pthread_cond_timedwait(&progressCondition, &progressMutex, &deadline) == 0) {
+			deadline.tv_sec -= progressInterval; // Woken by a finishing worker, same deadline
+			continue;
+		}
+
+		WorkerStats total = totalStats();
+		long long currentTime = now(), blocks = STAT_LOAD(blocksWritten);
+		double seconds = (double) (currentTime - previousTime) / NANOSECONDS_PER_SECOND;
+		double busy = total.ioNanoseconds + total.computeNanoseconds + total.mutexNanoseconds
+				+ total.conditionNanoseconds + total.writeNanoseconds;
+		busy = busy ? busy / 100 : 1; // For percentages
+		fprintf(stderr, "hw4: %lld blocks, %.1f MB read, %.1f MB/s, %.1f blocks/s"
+				" (io %.0f%%, xor %.0f%%, mutex %.0f%%, condition %.0f%%, write %.0f%%)\n",
+				blocks, total.bytesRead / 1048576.0, (total.bytesRead - previousBytes) / 1048576.0 / seconds,
+				(blocks - previousBlocks) / seconds, total.ioNanoseconds / busy, total.computeNanoseconds / busy,
+				total.mutexNanoseconds / busy, total.conditionNanoseconds / busy, total.writeNanoseconds / busy);
+
+		previousTime = currentTime;
+		previousBytes = total.bytesRead;
+		previousBlocks = blocks;
+	}
+	pthread_mutex_unlock(&progressMutex);
+}
+
+void writeStats(long long elapsed) {
+	FILE* stream = fopen(statsFileName, "w");
+	if (!stream) {
+		printf("ERROR: Could not open stats file %s.\n", statsFileName);
 		exit(1);
 	}
-	threadsLeft[0] = numberOfInputFiles; // On the first one - ALL OF THEM
 
-	if (pthread_mutex_init(&mutex, NULL)) { // Init mutex
-		printf("ERROR: Could not initiate mutex.\n");
+	double seconds = (double) elapsed / NANOSECONDS_PER_SECOND;
+	WorkerStats total = totalStats();
+	fprintf(stream, "{\n\t\"block_size\": %d,\n\t\"threads\": %d,\n\t\"input_files\": %d,\n", blockSize, numberOfThreads, numberOfInputFiles);
+	fprintf(stream, "\t\"elapsed_seconds\": %.6f,\n\t\"blocks_written\": %lld,\n\t\"bytes_written\": %lld,\n", seconds, blocksWritten, bytesWritten);
+	fprintf(stream, "\t\"bytes_read\": %lld,\n\t\"read_bytes_per_second\": %.1f,\n\t\"blocks_per_second\": %.3f,\n",
+			total.bytesRead, total.bytesRead / seconds, blocksWritten / seconds);
+	fprintf(stream, "\t\"workers\": [\n");
+	for (int i = 0; i < numberOfThreads; i++) {
+		WorkerStats* stats = &workerStats[i];
+		fprintf(stream, "\t\t{ \"bytes_read\": %lld, \"tasks\": %lld, \"io_seconds\": %.6f, \"xor_seconds\": %.6f, "
+				"\"mutex_wait_seconds\": %.6f, \"condition_wait_seconds\": %.6f, \"write_seconds\": %.6f }%s\n",
+				stats->bytesRead, stats->tasks, (double) stats->ioNanoseconds / NANOSECONDS_PER_SECOND,
+				(double) stats->computeNanoseconds / NANOSECONDS_PER_SECOND, (double) stats->mutexNanoseconds / NANOSECONDS_PER_SECOND,
+				(double) stats->conditionNanoseconds / NANOSECONDS_PER_SECOND, (double) stats->writeNanoseconds / NANOSECONDS_PER_SECOND,
+				i + 1 < numberOfThreads ? "," : "");
+	}
+	fprintf(stream, "\t]\n}\n");
+
+	if (fclose(stream)) {
+		printf("ERROR: Could not write stats file %s.\n", statsFileName);
 		exit(1);
 	}
+}
 
-	// Condition variables - one for each block
-	conditions = (pthread_cond_t*) malloc(sizeof(pthread_cond_t) * (maximumFileBlocks + 1));
-	if (!conditions) {
-		printf("ERROR: Could not allocate memory for condition variables.\n");
+/***
+ * One "CRC32C  PATH" line per file, inputs first - the output's checksum is of what was
+ * written, so comparing against a later pass over the disk catches anything that rotted.
+ * A compressed input's is of what it decodes to, not of its bytes on disk, so its line
+ * says so: "CRC32C  PATH (decoded)".
+ */
+void writeChecksums(const char* outputFileName, const char* qFileName) {
+	FILE* stream = fopen(checksumFileName, "w");
+	if (!stream) {
+		printf("ERROR: Could not open checksum file %s.\n", checksumFileName);
 		exit(1);
 	}
 
-	// Init condition variables
-	for (int i = 0; i < maximumFileBlocks + 1; i++) {
-		if (pthread_cond_init(&conditions[i], NULL)) {
-			printf("ERROR: Could not initiate condition variable for %d-th block.\n", i + 1);
-			exit(1);
+	for (int i = 0; i < numberOfInputFiles; i++) {
+		if (fileRoles[i] != ROLE_MISSING) {
+			fprintf(stream, "%08x  %s%s\n", inputChecksums[i], inputFiles[i], inputFormats[i] != DECODE_NONE ? " (decoded)" : "");
+		}
+	}
+	if (reconstruct) {
+		for (int i = 0; i < numberOfMissing; i++) {
+			fprintf(stream, "%08x  %s\n", outputChecksums[i], missing[i] ? inputFiles[missing[i] - 1] : outputFileName);
+		}
+	}
+	else {
+		fprintf(stream, "%08x  %s\n", outputChecksums[0], outputFileName);
+		if (qEnabled) {
+			fprintf(stream, "%08x  %s\n", outputChecksums[1], qFileName);
 		}
 	}
 
+	if (fclose(stream)) {
+		printf("ERROR: Could not write checksum file %s.\n", checksumFileName);
+		exit(1);
+	}
+}
+
+void runWorkers(void* (*worker)(void*)) {
+	memset(workerStats, 0, sizeof(WorkerStats) * numberOfThreads);
+	workersRunning = numberOfThreads;
+	startTime = now();
+
 	int ret;
-	for (int i = 0; i < numberOfInputFiles; i++) { // Create the threads
-		pthread_t thread_id;
-		ret = pthread_create(&thread_id, NULL, threadFileReader, (void*) argv[i + 2]);
+	for (int i = 0; i < numberOfThreads; i++) { // Create the workers
+		ret = pthread_create(&threads[i], NULL, worker, (void*) &workerStats[i]);
 		if (ret) {
-			printf("ERROR: Could not create thread for %d-th input file.\n", i + 1);
+			printf("ERROR: Could not create %d-th worker thread.\n", i + 1);
 			exit(1);
 		}
+	}
 
-		threads[i] = thread_id; // And keep track of them
+	if (progressInterval > 0) {
+		reportProgress();
 	}
 
-	for (int i = 0; i < numberOfInputFiles; i++) { // So we can join them
+	for (int i = 0; i < numberOfThreads; i++) { // So we can join them
 		ret = pthread_join(threads[i], NULL);
 		if (ret) {
-			printf("ERROR: Could not join thread for %d-th input file.\n", i + 1);
+			printf("ERROR: Could not join %d-th worker thread.\n", i + 1);
 			exit(1);
 		}
 	}
 
-	if (fstat(outputFileDescriptor, &st)) { // Get finished file size
-		printf("ERROR: Could not calculate output file's length.\n");
+	if (statsFileName) {
+		writeStats(now() - startTime);
+	}
+}
+
+int openFile(const char* path, int flags) {
+	int fileDescriptor = open(path, flags);
+	if (fileDescriptor == -1) {
+		printf("ERROR: Could not open %s.\n", path);
+		exit(1);
+	}
+	return fileDescriptor;
+}
+
+off_t fileSize(int fileDescriptor, const char* fileName) {
+	struct stat st;
+	if (fstat(fileDescriptor, &st)) {
+		printf("ERROR: Could not calculate %s's length.\n", fileName);
+		exit(1);
+	}
+	return st.st_size;
+}
+
+void printUsage() {
+	printf("USAGE: ./hw4 [-t THREADS] [-f MAX_OPEN_FILES] [-b BLOCK_SIZE] [-H] [-p SECONDS] [-s STATS_FILE] [-c CHECKSUM_FILE] [-m MANIFEST|-] [-q Q_FILE_PATH] [-r -x INDEX [-x INDEX]] [-u OLD_INPUT_FILE_PATH [-i INDEX]] <OUTPUT_FILE_PATH> [INPUT_FILE_PATH ...]\n");
+}
+
+/***
+ * A hole at the very end is only skipped over, so the size has to be set to where
+ * writing got to.
+ */
+void finishOutputFile(int fileDescriptor, const char* fileName) {
+	struct stat st;
+	off_t end = lseek(fileDescriptor, 0, SEEK_CUR);
+	if (end > 0 && !fstat(fileDescriptor, &st) && S_ISREG(st.st_mode) && st.st_size < end && ftruncate(fileDescriptor, end)) {
+		printf("ERROR: Could not extend %s to %ld bytes.\n", fileName, (long) end);
 		exit(1);
 	}
+}
 
-	close(outputFileDescriptor); // Close file
-	printf("Created %s with size %ld bytes\n", outputFileName, st.st_size);
+void printFileSize(int fileDescriptor, const char* verb, const char* fileName) {
+	off_t size = fileSize(fileDescriptor, fileName); // Get finished file size
+	close(fileDescriptor); // Close file
+	printf("%s %s with size %ld bytes\n", verb, fileName, (long) size);
+}
 
-	cleanUp(maximumFileBlocks); // Cleanliness is next to holiness
+void removeRebuiltFiles() { // At exit - whatever wasn't renamed into place didn't work out
+	for (int i = 0; i < numberOfMissing; i++) {
+		if (rebuiltPaths[i]) {
+			unlink(rebuiltPaths[i]);
+		}
+	}
+}
+
+int createRebuiltFile(int index, const char* path) {
+	if (!(rebuiltPaths[index] = (char*) malloc(strlen(path) + 32))) {
+		printf("ERROR: Could not allocate memory for %s's path.\n", path);
+		exit(1);
+	}
+	sprintf(rebuiltPaths[index], "%s.rebuild.%d", path, (int) getpid());
+	if (!index && atexit(removeRebuiltFiles)) {
+		printf("ERROR: Could not register exit handler.\n");
+		exit(1);
+	}
+
+	int fileDescriptor = open(rebuiltPaths[index], O_RDWR | O_CREAT | O_TRUNC, // Read back for the last byte
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (fileDescriptor == -1) {
+		printf("ERROR: Could not open output file %s.\n", rebuiltPaths[index]);
+		exit(1);
+	}
+	return fileDescriptor;
+}
+
+/***
+ * Puts the rebuilt file where the missing one was. Parity is as long as the longest
+ * shard, and so is everything rebuilt from it - a shorter shard comes back padded
+ * with zeros, and the lengths aren't recorded anywhere to trim it by.
+ */
+void finishRebuiltFile(int index, const char* path) {
+	char last = 1;
+	int fileDescriptor = missingDescriptors[index];
+	finishOutputFile(fileDescriptor, rebuiltPaths[index]);
+	off_t size = fileSize(fileDescriptor, rebuiltPaths[index]);
+	if (rename(rebuiltPaths[index], path)) {
+		printf("ERROR: Could not rename %s to %s.\n", rebuiltPaths[index], path);
+		exit(1);
+	}
+	free(rebuiltPaths[index]);
+	rebuiltPaths[index] = NULL;
+
+	int padded = missing[index] && size && pread(fileDescriptor, &last, 1, size - 1) == 1 && !last;
+	printFileSize(fileDescriptor, "Rebuilt", path);
+	if (padded) {
+		printf("WARNING: %s ends in zeros - if it was shorter than the parity, they're padding.\n", path);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	numberOfThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	maximumOpenFiles = -1;
+	char* manifest = NULL;
+	char* qFileName = NULL;
+
+	int option;
+	while ((option = getopt(argc, argv, "t:f:m:q:rx:u:i:b:Hp:s:c:")) != -1) {
+		switch (option) {
+			case 't':
+				numberOfThreads = atoi(optarg);
+				break;
+			case 'f':
+				maximumOpenFiles = atoi(optarg);
+				break;
+			case 'm':
+				manifest = optarg;
+				break;
+			case 'q':
+				qFileName = optarg;
+				qEnabled = 1;
+				break;
+			case 'u':
+				oldInputFileName = optarg;
+				break;
+			case 'i':
+				updatedShard = atoi(optarg);
+				break;
+			case 'b':
+				blockSize = parseBlockSize(optarg);
+				break;
+			case 'H':
+				useHugePages = 1;
+				break;
+			case 'p':
+				progressInterval = atoi(optarg);
+				break;
+			case 's':
+				statsFileName = optarg;
+				break;
+			case 'c':
+				checksumFileName = optarg;
+				break;
+			case 'r':
+				reconstruct = 1;
+				break;
+			case 'x':
+				if (numberOfMissing == MAXIMUM_MISSING) {
+					printf("ERROR: Can only rebuild up to %d missing files.\n", MAXIMUM_MISSING);
+					exit(1);
+				}
+				missing[numberOfMissing++] = atoi(optarg);
+				break;
+			default: // Can you repeat that?
+				printUsage();
+				exit(1);
+		}
+	}
+
+	if (argc - optind < 1 || numberOfThreads < 1 || reconstruct != !!numberOfMissing) {
+		printUsage();
+		exit(1);
+	}
+
+	char* outputFileName = argv[optind];
+	if (manifest) {
+		readManifest(manifest);
+	}
+	for (int i = optind + 1; i < argc; i++) {
+		addInputFile(argv[i]);
+	}
+	numberOfShards = numberOfInputFiles;
+
+	if (!numberOfShards) {
+		printUsage();
+		exit(1);
+	}
+	if (qEnabled && numberOfShards > MAXIMUM_Q_SHARDS) {
+		printf("ERROR: Q syndrome supports up to %d input files.\n", MAXIMUM_Q_SHARDS);
+		exit(1);
+	}
+
+	if (numberOfMissing == MAXIMUM_MISSING && missing[0] > missing[1]) { // Keep them sorted, P (0) first
+		int temp = missing[0];
+		missing[0] = missing[1];
+		missing[1] = temp;
+	}
+	for (int i = 0; i < numberOfMissing; i++) {
+		if (missing[i] < 0 || missing[i] > numberOfShards || (i && missing[i] == missing[i - 1])) {
+			printf("ERROR: Invalid missing file index %d.\n", missing[i]);
+			exit(1);
+		}
+	}
+	if (reconstruct && (numberOfMissing == MAXIMUM_MISSING || !missing[0]) && !qEnabled) {
+		printf("ERROR: Rebuilding two files, or one along with P, needs the Q file.\n");
+		exit(1);
+	}
+	if (oldInputFileName && (reconstruct || numberOfShards != 1 || (qEnabled && (updatedShard < 1 || updatedShard > MAXIMUM_Q_SHARDS)))) {
+		printf("ERROR: Updating takes exactly one (new) input file, and its index (-i) for Q.\n");
+		exit(1);
+	}
+	if (oldInputFileName && checksumFileName) {
+		printf("ERROR: Updating only reads the blocks that changed, there's no pass to checksum.\n");
+		exit(1);
+	}
+	if (reconstruct && numberOfMissing == 1 && !missing[0]) {
+		printf("ERROR: Nothing to rebuild, P alone can be recreated without -r.\n");
+		exit(1);
+	}
+
+	fileRoles = (char*) calloc(numberOfShards + 2, 1); // Room for the parity inputs
+	if (!fileRoles) {
+		printf("ERROR: Could not allocate memory for stage management.\n");
+		exit(1);
+	}
+	if (reconstruct) { // Parity files become inputs, missing shards become outputs
+		for (int i = 0; i < numberOfMissing; i++) {
+			if (missing[i]) {
+				fileRoles[missing[i] - 1] = ROLE_MISSING;
+			}
+		}
+
+		if (missing[0]) {
+			fileRoles[numberOfInputFiles] = ROLE_P;
+			addInputFile(outputFileName);
+		}
+		if (qEnabled) {
+			fileRoles[numberOfInputFiles] = ROLE_Q;
+			addInputFile(qFileName);
+		}
+
+		for (int i = 0; i < numberOfInputFiles; i++) { // Every source has to be there before anything's written
+			if (fileRoles[i] != ROLE_MISSING) {
+				close(openFile(inputFiles[i], O_RDONLY));
+			}
+		}
+		for (int i = 0; i < numberOfMissing; i++) {
+			missingDescriptors[i] = createRebuiltFile(i, missing[i] ? inputFiles[missing[i] - 1] : outputFileName);
+		}
+	}
+
+	int numberOfActiveFiles = numberOfInputFiles - (reconstruct ? numberOfMissing - !missing[0] : 0);
+	if (!oldInputFileName && numberOfThreads > numberOfActiveFiles) {
+		numberOfThreads = numberOfActiveFiles; // No point in more workers than files
+	}
+	maximumDecoders = (int) sysconf(_SC_NPROCESSORS_ONLN); // More decoding ahead than there are cores buys nothing
+	decodeThreads = maximumDecoders / numberOfActiveFiles; // Shared out among the compressed inputs
+	if (decodeThreads < 1) {
+		decodeThreads = 1;
+	}
+
+	if (maximumOpenFiles < 0) { // Leave room for the workers' transient opens
+		struct rlimit limit;
+		if (getrlimit(RLIMIT_NOFILE, &limit)) {
+			printf("ERROR: Could not get open files limit.\n");
+			exit(1);
+		}
+		maximumOpenFiles = (int) limit.rlim_cur - numberOfThreads - FILE_DESCRIPTOR_SLACK;
+		if (maximumOpenFiles < 0) {
+			maximumOpenFiles = 0;
+		}
+	}
+
+	gfInit();
+	gfMultiplyXor = gfMultiplyXorTable;
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("ssse3")) {
+		gfMultiplyXor = gfMultiplyXorShuffle;
+	}
+#endif
+	crc32cInit();
+	crc32c = crc32cTableDriven;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c = crc32cHardware;
+	}
+#endif
+
+	if (oldInputFileName) { // Previous outputs are updated, not created
+		printf("Hello, updating %s from %s to %s\n", outputFileName, oldInputFileName, inputFiles[0]);
+		oldInputFileDescriptor = openFile(oldInputFileName, O_RDONLY);
+		newInputFileDescriptor = openFile(inputFiles[0], O_RDONLY);
+		outputFileDescriptor = openFile(outputFileName, O_RDWR);
+		if (qEnabled) {
+			qOutputFileDescriptor = openFile(qFileName, O_RDWR);
+		}
+
+		if (!isSeekable(oldInputFileDescriptor) || !isSeekable(newInputFileDescriptor)) {
+			printf("ERROR: Updating reads blocks out of order, it can't take pipes as inputs.\n");
+			exit(1);
+		}
+		if (decodeFormat(oldInputFileDescriptor) != DECODE_NONE || decodeFormat(newInputFileDescriptor) != DECODE_NONE) {
+			printf("ERROR: Updating reads only the blocks that changed, it can't take compressed inputs.\n");
+			exit(1);
+		}
+
+		off_t oldSize = fileSize(oldInputFileDescriptor, oldInputFileName);
+		off_t newSize = fileSize(newInputFileDescriptor, inputFiles[0]);
+		updateBlocks = ((oldSize > newSize ? oldSize : newSize) + blockSize - 1) / blockSize;
+	}
+	else if (reconstruct) {
+		printf("Hello, rebuilding %d missing files from %d input files\n", numberOfMissing, numberOfActiveFiles);
+	}
+	else {
+		printf("Hello, creating %s from %d input files\n", outputFileName, numberOfShards);
+		outputFileDescriptor = createOutputFile(outputFileName);
+		if (qEnabled) {
+			qOutputFileDescriptor = createOutputFile(qFileName);
+		}
+	}
+
+	// So we can join them later
+	threads = (pthread_t*) malloc(sizeof(pthread_t) * numberOfThreads);
+	fileDescriptors = (int*) malloc(sizeof(int) * numberOfInputFiles);
+	activeFiles = (int*) malloc(sizeof(int) * numberOfInputFiles);
+	fileEnded = (char*) calloc(numberOfInputFiles, 1);
+	decoders = (Decoder**) calloc(numberOfInputFiles, sizeof(Decoder*));
+	inputFormats = (int*) calloc(numberOfInputFiles, sizeof(int)); // DECODE_NONE's 0
+	inputChecksums = (uint32_t*) calloc(numberOfInputFiles, sizeof(uint32_t));
+	if (posix_memalign((void**) &workerStats, sizeof(WorkerStats), sizeof(WorkerStats) * numberOfThreads)) {
+		workerStats = NULL;
+	}
+	if (!threads || !workerStats || !fileDescriptors || !activeFiles || !fileEnded || !decoders || !inputFormats || !inputChecksums) {
+		printf("ERROR: Could not allocate memory for stage management.\n");
+		exit(1);
+	}
+	xoredBuffer = allocateBuffer();
+	qBuffer = qEnabled ? allocateBuffer() : NULL;
+	for (int i = 0; i < numberOfMissing; i++) {
+		rebuiltBuffers[i] = allocateBuffer();
+	}
+
+	activeCount = 0;
+	for (int i = 0; i < numberOfInputFiles; i++) {
+		fileDescriptors[i] = -1;
+		if (fileRoles[i] != ROLE_MISSING) {
+			activeFiles[activeCount++] = i; // On the first block - ALL OF THEM
+		}
+	}
+	workersLeft = numberOfThreads;
+
+	if (pthread_mutex_init(&mutex, NULL)) { // Init mutex
+		printf("ERROR: Could not initiate mutex.\n");
+		exit(1);
+	}
+
+	if (pthread_cond_init(&stageCondition, NULL) || pthread_cond_init(&progressCondition, NULL)) {
+		printf("ERROR: Could not initiate condition variable.\n");
+		exit(1);
+	}
+
+	if (pthread_mutex_init(&progressMutex, NULL)) {
+		printf("ERROR: Could not initiate mutex.\n");
+		exit(1);
+	}
+
+	runWorkers(oldInputFileName ? threadUpdater : threadWorker);
+	if (checksumFileName) {
+		writeChecksums(outputFileName, qFileName);
+	}
+
+	if (oldInputFileName) {
+		close(oldInputFileDescriptor);
+		close(newInputFileDescriptor);
+		printf("Updated %lld of %ld blocks\n", blocksWritten, (long) updateBlocks);
+		printFileSize(outputFileDescriptor, "Updated", outputFileName);
+		if (qEnabled) {
+			printFileSize(qOutputFileDescriptor, "Updated", qFileName);
+		}
+	}
+	else if (reconstruct) {
+		for (int i = 0; i < numberOfMissing; i++) {
+			finishRebuiltFile(i, missing[i] ? inputFiles[missing[i] - 1] : outputFileName);
+		}
+	}
+	else {
+		finishOutputFile(outputFileDescriptor, outputFileName);
+		printFileSize(outputFileDescriptor, "Created", outputFileName);
+		if (qEnabled) {
+			finishOutputFile(qOutputFileDescriptor, qFileName);
+			printFileSize(qOutputFileDescriptor, "Created", qFileName);
+		}
+	}
+
+	cleanUp(); // Cleanliness is next to holiness
 
 	pthread_exit(NULL); // Finished, thank you very much!
-}
\ No newline at end of file
+}
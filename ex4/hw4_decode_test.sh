@@ -0,0 +1,50 @@
+#!/bin/bash
+# XORs COUNT (default 300) gzipped inputs of 4M and change - more than a
+# decoder's chunks hold, so one decoding ahead keeps its thread and chunks -
+# under a lower open files limit than there are inputs. Checks that hw4
+# neither runs out of descriptors nor has a decoder thread and chunks per
+# input, and that the output's the same as from the inputs uncompressed.
+# Peak threads and RSS are read off /proc while it runs.
+# HW4 (default ./hw4), DATA (default /tmp/hw4_decode_test) and OPEN_FILES
+# (the limit it runs under, default 128) can be set from the environment.
+HW4=$(realpath ${HW4:-./hw4})
+DATA=${DATA:-/tmp/hw4_decode_test}
+OPEN_FILES=${OPEN_FILES:-128}
+COUNT=${1:-300}
+THREADS_LIMIT=$((2 * $(nproc) + 8)) # Workers, the decoders that decode ahead, and a few to spare
+RSS_LIMIT_KB=$((COUNT * 256 + 256 * 1024)) # A thread and three chunks each would be over 3M an input
+
+fail() {
+	echo "hw4_decode_test: $1" >&2
+	exit 1
+}
+
+rm -rf $DATA
+mkdir -p $DATA || exit 1
+for i in $(seq $COUNT); do # Mostly a hole, so it's quick to make and to compress
+	truncate -s $((4 * 1024 * 1024 + RANDOM * 16)) $DATA/input_$i || exit 1
+	for OFFSET in 0 2048 4095; do # KB
+		head -c 64K /dev/urandom | dd of=$DATA/input_$i bs=1K seek=$OFFSET conv=notrunc status=none || exit 1
+	done
+	gzip -1 -c $DATA/input_$i > $DATA/input_$i.gz || exit 1
+done
+
+(cd $DATA && ulimit -n $OPEN_FILES && exec $HW4 -b 1M plain.out $(seq -f input_%g $COUNT)) > /dev/null || fail "hw4 failed on the plain inputs"
+(cd $DATA && ulimit -n $OPEN_FILES && exec $HW4 -b 1M decoded.out $(seq -f input_%g.gz $COUNT)) > /dev/null &
+PID=$!
+PEAK_THREADS=0
+PEAK_RSS_KB=0
+while kill -0 $PID 2> /dev/null; do
+	read THREADS RSS_KB < <(awk '/^Threads:/ { threads = $2 } /^VmHWM:/ { rss = $2 } END { print threads + 0, rss + 0 }' /proc/$PID/status 2> /dev/null)
+	[ "${THREADS:-0}" -gt $PEAK_THREADS ] && PEAK_THREADS=$THREADS
+	[ "${RSS_KB:-0}" -gt $PEAK_RSS_KB ] && PEAK_RSS_KB=$RSS_KB
+	sleep 0.05
+done
+wait $PID || fail "hw4 failed on $COUNT gzipped inputs with $OPEN_FILES open files"
+
+echo "hw4_decode_test: $COUNT inputs, peak $PEAK_THREADS threads, peak RSS $((PEAK_RSS_KB / 1024))M"
+cmp -s $DATA/plain.out $DATA/decoded.out || fail "decoded inputs gave a different output"
+[ $PEAK_THREADS -le $THREADS_LIMIT ] || fail "$PEAK_THREADS threads, more than $THREADS_LIMIT"
+[ $PEAK_RSS_KB -le $RSS_LIMIT_KB ] || fail "peak RSS of $PEAK_RSS_KB KB, more than $RSS_LIMIT_KB KB"
+rm -rf $DATA
+echo "hw4_decode_test: passed"
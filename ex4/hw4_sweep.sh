@@ -0,0 +1,25 @@
+#!/bin/bash
+# Runs hw4 over the same inputs with every block size from 64K to 64M and
+# reports throughput (input bytes / wall time) for each.
+# HW4 (default ./hw4), OUTPUT (default /tmp/hw4_sweep.out) and HW4_FLAGS
+# (e.g. "-t 8 -H") can be set from the environment.
+HW4=${HW4:-./hw4}
+OUTPUT=${OUTPUT:-/tmp/hw4_sweep.out}
+
+if [ $# -lt 1 ]; then
+	echo "USAGE: $0 <INPUT_FILE_PATH> [...]"
+	exit 1
+fi
+
+TOTAL_BYTES=$(stat -c %s "$@" | awk '{ total += $1 } END { print total }')
+echo "block_size_kb,seconds,mb_per_second"
+for BLOCK_SIZE in 64K 128K 256K 512K 1M 2M 4M 8M 16M 32M 64M; do
+	START=$(date +%s%N)
+	$HW4 $HW4_FLAGS -b $BLOCK_SIZE $OUTPUT "$@" > /dev/null || exit 1
+	END=$(date +%s%N)
+	awk -v size=$BLOCK_SIZE -v bytes=$TOTAL_BYTES -v ns=$((END - START)) 'BEGIN {
+		kb = size + 0; if (size ~ /M$/) kb *= 1024
+		printf "%d,%.3f,%.1f\n", kb, ns / 1e9, bytes / 1048576 / (ns / 1e9)
+	}'
+done
+rm -f $OUTPUT
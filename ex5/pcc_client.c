@@ -1,14 +1,60 @@
+#define _GNU_SOURCE
+#include "pcc_protocol.h"
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BUFFER_SIZE 1024
+#define MAXIMUM_PAYLOAD_BUFFER_SIZE (64 * 1024 * 1024) // Longer payloads send it over and over
+#define IN_FLIGHT (4 * 1024) // Per connection, requests sent but not answered yet, when paced
+#define EXPONENTIAL_CAP 8 // Exponential sizes are cut off at this many times the mean
+
+#define DISTRIBUTION_FIXED 0
+#define DISTRIBUTION_UNIFORM 1 // 1 to twice the length
+#define DISTRIBUTION_EXPONENTIAL 2
+
+typedef struct sender_t { // What the sending thread needs, version 2 only
+	int sock;
+	int urandomDescriptor;
+	uint64_t length; // Of each request
+	uint64_t numberOfRequests;
+} Sender;
+
+typedef struct load_connection_t { // A load generator connection, run by its own thread(s)
+	pthread_t thread;
+	int sock;
+	uint64_t random; // xorshift64 state for payload sizes
+	uint64_t requestsDone; // Atomically, the sender waits on it in paced runs
+	uint64_t bytesSent;
+	uint64_t* sentAt; // IN_FLIGHT intended send times, by sequence - paced runs only
+	uint64_t* latencies; // Nanoseconds
+	size_t numberOfLatencies;
+	size_t latencyCapacity;
+} LoadConnection;
+
+int numberOfConnections = 0; // Load generator mode if > 0
+double duration = 10; // Seconds
+double rate = 0; // Requests per second, over all connections - 0 for closed loop
+uint64_t interval; // Nanoseconds between a connection's requests, when paced
+int distribution = DISTRIBUTION_FIXED;
+uint64_t meanLength;
+int payloadDescriptor; // A memfd full of random bytes, sendfile()'d from
+size_t payloadSize;
+uint64_t endTime;
 
 int isIpAddress(char* address) {
 	int i = 0;
@@ -25,15 +71,507 @@ int isIpAddress(char* address) {
 	return 1;
 }
 
-int main(int argc, char* argv[]) {
-	uint16_t serverPort = (unsigned int) atoi(argv[2]);
-	uint32_t length = (unsigned int) atoi(argv[3]);
-	char* buffer = (char*) malloc(sizeof(char) * BUFFER_SIZE);
+int sendAll(int sock, const void* data, size_t size) {
+	const char* sendBuffer = (const char*) data;
+	ssize_t sent;
+	while (size > 0) {
+		if ((sent = write(sock, sendBuffer, size)) < 0) {
+			return -1;
+		}
 
+		sendBuffer += sent;
+		size -= sent;
+	}
+
+	return 0;
+}
+
+/***
+ * Returns -1 on errors, 0 if the server closed the connection before sending anything.
+ */
+int receiveAll(int sock, void* data, size_t size) {
+	char* ret = (char*) data;
+	ssize_t received;
+	while (size > 0) {
+		if ((received = read(sock, ret, size)) < 0) {
+			return -1;
+		}
+		if (!received) {
+			if (ret == (char*) data) {
+				return 0;
+			}
+			errno = ECONNRESET; // Cut off mid-message
+			return -1;
+		}
+
+		ret += received;
+		size -= received;
+	}
+
+	return 1;
+}
+
+/***
+ * Sends length random bytes.
+ */
+int sendRandom(int sock, int urandomDescriptor, uint64_t length) {
+	char buffer[BUFFER_SIZE];
+	int toRead;
+	while (length > 0) {
+		toRead = length > BUFFER_SIZE ? BUFFER_SIZE : (int) length;
+		length -= toRead;
+		if (read(urandomDescriptor, buffer, toRead) != toRead) {
+			perror("pcc_client: Could not read from /dev/urandom");
+			return -1;
+		}
+
+		if (sendAll(sock, buffer, toRead) < 0) {
+			perror("pcc_client: Could not send message to server");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/***
+ * Pipelines all the requests, then half-closes - the responses are read on the main
+ * thread meanwhile, so neither side stalls on a full socket buffer.
+ */
+void* threadSender(void* thread_param) {
+	Sender* sender = (Sender*) thread_param;
+	for (uint64_t sequence = 0; sequence < sender->numberOfRequests; sequence++) {
+		uint64_t request[2] = { htobe64(sequence), htobe64(sender->length) };
+		if (sendAll(sender->sock, request, sizeof(request)) < 0) {
+			perror("pcc_client: Could not send request header to server");
+			exit(1);
+		}
+		if (sendRandom(sender->sock, sender->urandomDescriptor, sender->length) < 0) {
+			exit(1);
+		}
+	}
+
+	if (shutdown(sender->sock, SHUT_WR) < 0) {
+		perror("pcc_client: Could not close connection for writing");
+		exit(1);
+	}
+
+	return (void*) 0;
+}
+
+int connectToServer(struct sockaddr_in* serverAddress) {
 	int sock;
 	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
 		perror("pcc_client: Could not create socket");
-		return errno;
+		return -1;
+	}
+
+	if (connect(sock, (struct sockaddr*) serverAddress, sizeof(*serverAddress)) < 0) {
+		perror("pcc_client: Could not connect to server");
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+int runVersion1(int sock, int urandomDescriptor, uint32_t length) {
+	uint32_t networkLength = htonl(length);
+	if (sendAll(sock, &networkLength, sizeof(networkLength)) < 0) {
+		perror("pcc_client: Could not send message length to server");
+		return 1;
+	}
+
+	if (sendRandom(sock, urandomDescriptor, length) < 0) {
+		return 1;
+	}
+
+	uint32_t C;
+	if (receiveAll(sock, &C, sizeof(C)) <= 0) {
+		perror("pcc_client: Could not read message from server");
+		return 1;
+	}
+
+	printf("# of printable characters: %u\n", ntohl(C));
+	return 0;
+}
+
+int handshake(int sock) {
+	uint32_t escape = htonl(PCC_V2_ESCAPE);
+	char magic[PCC_V2_MAGIC_SIZE];
+	if (sendAll(sock, &escape, sizeof(escape)) < 0 || sendAll(sock, PCC_V2_MAGIC, PCC_V2_MAGIC_SIZE) < 0) {
+		perror("pcc_client: Could not send handshake to server");
+		return -1;
+	}
+	if (receiveAll(sock, magic, sizeof(magic)) <= 0 || memcmp(magic, PCC_V2_MAGIC, PCC_V2_MAGIC_SIZE)) {
+		fprintf(stderr, "pcc_client: Server does not speak version 2\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int runVersion2(int sock, int urandomDescriptor, uint64_t length, uint64_t numberOfRequests) {
+	if (handshake(sock) < 0) {
+		return 1;
+	}
+
+	Sender sender = { sock, urandomDescriptor, length, numberOfRequests };
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, threadSender, (void*) &sender)) {
+		perror("pcc_client: Failed to create sender thread");
+		return 1;
+	}
+
+	uint64_t response[2];
+	for (uint64_t i = 0; i < numberOfRequests; i++) {
+		if (receiveAll(sock, response, sizeof(response)) <= 0) {
+			perror("pcc_client: Could not read response from server");
+			return 1;
+		}
+		if (be64toh(response[0]) != i) {
+			fprintf(stderr, "pcc_client: Response out of order\n");
+			return 1;
+		}
+
+		printf("# of printable characters: %llu\n", (unsigned long long) be64toh(response[1]));
+	}
+
+	pthread_join(thread, NULL);
+	return 0;
+}
+
+uint64_t now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+uint64_t nextRandom(uint64_t* state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/***
+ * Fills a memfd with PRNG bytes once, so requests cost a sendfile() instead of
+ * reading /dev/urandom and copying it through userspace every time.
+ */
+int createPayload(uint64_t maximumLength) {
+	payloadSize = maximumLength > MAXIMUM_PAYLOAD_BUFFER_SIZE ? MAXIMUM_PAYLOAD_BUFFER_SIZE : (size_t) maximumLength;
+	if (!payloadSize) {
+		payloadSize = 1;
+	}
+	if ((payloadDescriptor = memfd_create("pcc_payload", 0)) < 0 || ftruncate(payloadDescriptor, payloadSize) < 0) {
+		perror("pcc_client: Could not create payload buffer");
+		return -1;
+	}
+
+	unsigned char* payload = (unsigned char*) mmap(NULL, payloadSize, PROT_WRITE, MAP_SHARED, payloadDescriptor, 0);
+	if (payload == MAP_FAILED) {
+		perror("pcc_client: Could not map payload buffer");
+		return -1;
+	}
+	uint64_t state = 88172645463325252ULL, word;
+	for (size_t i = 0; i < payloadSize; i += sizeof(word)) {
+		word = nextRandom(&state);
+		memcpy(payload + i, &word, payloadSize - i < sizeof(word) ? payloadSize - i : sizeof(word));
+	}
+
+	munmap(payload, payloadSize);
+	return 0;
+}
+
+int sendPayload(int sock, uint64_t length) {
+	while (length > 0) {
+		off_t offset = 0;
+		size_t toSend = length > payloadSize ? payloadSize : (size_t) length;
+		while (offset < (off_t) toSend) { // sendfile() moves the offset along
+			if (sendfile(sock, payloadDescriptor, &offset, toSend - offset) < 0) {
+				return -1;
+			}
+		}
+
+		length -= toSend;
+	}
+
+	return 0;
+}
+
+uint64_t nextLength(LoadConnection* connection) {
+	switch (distribution) {
+		case DISTRIBUTION_UNIFORM:
+			return 1 + nextRandom(&connection->random) % (2 * meanLength);
+		case DISTRIBUTION_EXPONENTIAL: {
+			double uniform = (nextRandom(&connection->random) >> 11) * (1.0 / 9007199254740992.0); // [0, 1)
+			double length = -log1p(-uniform) * meanLength;
+			return length > (double) (EXPONENTIAL_CAP * meanLength) ? EXPONENTIAL_CAP * meanLength : (uint64_t) length;
+		}
+		default:
+			return meanLength;
+	}
+}
+
+void recordLatency(LoadConnection* connection, uint64_t latency) {
+	if (connection->numberOfLatencies == connection->latencyCapacity) {
+		connection->latencyCapacity = connection->latencyCapacity ? connection->latencyCapacity * 2 : 4096;
+		if (!(connection->latencies = (uint64_t*) realloc(connection->latencies, connection->latencyCapacity * sizeof(uint64_t)))) {
+			perror("pcc_client: Could not allocate latencies");
+			exit(1);
+		}
+	}
+
+	connection->latencies[connection->numberOfLatencies++] = latency;
+}
+
+int sendRequest(LoadConnection* connection, uint64_t sequence) {
+	uint64_t length = nextLength(connection);
+	uint64_t request[2] = { htobe64(sequence), htobe64(length) };
+	// MSG_MORE holds the header back to go out with the payload's first segment
+	if (send(connection->sock, request, sizeof(request), length ? MSG_MORE : 0) != sizeof(request)
+			|| sendPayload(connection->sock, length) < 0) {
+		perror("pcc_client: Could not send request to server");
+		return -1;
+	}
+
+	connection->bytesSent += length;
+	return 0;
+}
+
+int receiveResponse(LoadConnection* connection, uint64_t sequence) {
+	uint64_t response[2];
+	if (receiveAll(connection->sock, response, sizeof(response)) <= 0) {
+		perror("pcc_client: Could not read response from server");
+		return -1;
+	}
+	if (be64toh(response[0]) != sequence) {
+		fprintf(stderr, "pcc_client: Response out of order\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/***
+ * Paced runs: sends on schedule, whether or not the answers keep up. Latency is
+ * measured from when a request was due, not when it went out, so a stalled server
+ * can't hide its stall by slowing the sender down.
+ */
+void* threadPacedSender(void* thread_param) {
+	LoadConnection* connection = (LoadConnection*) thread_param;
+	uint64_t due = now() + nextRandom(&connection->random) % interval; // Don't all start at once
+
+	// A sender that fell behind schedule still stops when the run's over
+	for (uint64_t sequence = 0; due < endTime && now() < endTime; sequence++, due += interval) {
+		while (sequence - __atomic_load_n(&connection->requestsDone, __ATOMIC_ACQUIRE) >= IN_FLIGHT) {
+			usleep(100); // Way behind - the latencies will say so
+		}
+
+		struct timespec wakeUp = { (time_t) (due / 1000000000ULL), (long) (due % 1000000000ULL) };
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeUp, NULL) == EINTR);
+
+		connection->sentAt[sequence % IN_FLIGHT] = due;
+		if (sendRequest(connection, sequence) < 0) {
+			exit(1);
+		}
+	}
+
+	if (shutdown(connection->sock, SHUT_WR) < 0) {
+		perror("pcc_client: Could not close connection for writing");
+		exit(1);
+	}
+
+	return (void*) 0;
+}
+
+void* threadLoad(void* thread_param) {
+	LoadConnection* connection = (LoadConnection*) thread_param;
+	uint64_t sequence = 0, start;
+
+	if (rate <= 0) { // Closed loop - the next request goes out when the last one's answered
+		while ((start = now()) < endTime) {
+			if (sendRequest(connection, sequence) < 0 || receiveResponse(connection, sequence) < 0) {
+				exit(1);
+			}
+
+			recordLatency(connection, now() - start);
+			connection->requestsDone = ++sequence;
+		}
+
+		return (void*) 0;
+	}
+
+	pthread_t sender;
+	if (pthread_create(&sender, NULL, threadPacedSender, (void*) connection)) {
+		perror("pcc_client: Failed to create sender thread");
+		exit(1);
+	}
+
+	uint64_t response[2];
+	int received;
+	while ((received = receiveAll(connection->sock, response, sizeof(response))) > 0) {
+		if (be64toh(response[0]) != sequence) {
+			fprintf(stderr, "pcc_client: Response out of order\n");
+			exit(1);
+		}
+
+		recordLatency(connection, now() - connection->sentAt[sequence % IN_FLIGHT]);
+		__atomic_store_n(&connection->requestsDone, ++sequence, __ATOMIC_RELEASE);
+	}
+	if (received < 0) {
+		perror("pcc_client: Could not read response from server");
+		exit(1);
+	}
+
+	pthread_join(sender, NULL);
+	return (void*) 0;
+}
+
+int compareLatencies(const void* a, const void* b) {
+	uint64_t first = *(const uint64_t*) a, second = *(const uint64_t*) b;
+	return (first > second) - (first < second);
+}
+
+double percentile(uint64_t* latencies, size_t count, double fraction) {
+	size_t index = (size_t) (fraction * count);
+	return (count ? latencies[index < count ? index : count - 1] : 0) / 1e3; // Microseconds
+}
+
+int runLoad(struct sockaddr_in* serverAddress) {
+	LoadConnection* connections = (LoadConnection*) calloc(numberOfConnections, sizeof(LoadConnection));
+	if (!connections) {
+		perror("pcc_client: Could not allocate connections");
+		return 1;
+	}
+	if (createPayload(distribution == DISTRIBUTION_FIXED ? meanLength
+			: (distribution == DISTRIBUTION_UNIFORM ? 2 : EXPONENTIAL_CAP) * meanLength) < 0) {
+		return 1;
+	}
+
+	for (int i = 0; i < numberOfConnections; i++) { // All connected and greeted before the clock starts
+		connections[i].random = 0x9E3779B97F4A7C15ULL * (i + 1);
+		if ((connections[i].sock = connectToServer(serverAddress)) < 0 || handshake(connections[i].sock) < 0) {
+			return 1;
+		}
+		int enable = 1; // Small requests shouldn't wait for Nagle
+		if (setsockopt(connections[i].sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0) {
+			perror("pcc_client: Could not set TCP_NODELAY");
+			return 1;
+		}
+		if (rate > 0 && !(connections[i].sentAt = (uint64_t*) malloc(IN_FLIGHT * sizeof(uint64_t)))) {
+			perror("pcc_client: Could not allocate connections");
+			return 1;
+		}
+	}
+
+	uint64_t start = now();
+	endTime = start + (uint64_t) (duration * 1e9);
+	for (int i = 0; i < numberOfConnections; i++) {
+		if (pthread_create(&connections[i].thread, NULL, threadLoad, (void*) &connections[i])) {
+			perror("pcc_client: Failed to create connection thread");
+			return 1;
+		}
+	}
+
+	size_t numberOfLatencies = 0;
+	uint64_t bytesSent = 0;
+	for (int i = 0; i < numberOfConnections; i++) {
+		pthread_join(connections[i].thread, NULL);
+		numberOfLatencies += connections[i].numberOfLatencies;
+		bytesSent += connections[i].bytesSent;
+		close(connections[i].sock);
+	}
+	double elapsed = (now() - start) / 1e9;
+
+	uint64_t* latencies = (uint64_t*) malloc((numberOfLatencies ? numberOfLatencies : 1) * sizeof(uint64_t));
+	if (!latencies) {
+		perror("pcc_client: Could not allocate latencies");
+		return 1;
+	}
+	for (int i = 0, j = 0; i < numberOfConnections; i++) {
+		memcpy(latencies + j, connections[i].latencies, connections[i].numberOfLatencies * sizeof(uint64_t));
+		j += connections[i].numberOfLatencies;
+		free(connections[i].latencies);
+		free(connections[i].sentAt);
+	}
+	qsort(latencies, numberOfLatencies, sizeof(uint64_t), compareLatencies);
+
+	printf("connections: %d\n", numberOfConnections);
+	printf("requests: %zu in %.2f seconds\n", numberOfLatencies, elapsed);
+	printf("throughput: %.1f requests/s, %.1f MB/s\n", numberOfLatencies / elapsed, bytesSent / elapsed / 1048576);
+	printf("latency (us): p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n", percentile(latencies, numberOfLatencies, 0.5),
+			percentile(latencies, numberOfLatencies, 0.99), percentile(latencies, numberOfLatencies, 0.999),
+			percentile(latencies, numberOfLatencies, 1));
+
+	close(payloadDescriptor);
+	free(latencies);
+	free(connections);
+	return 0;
+}
+
+void printUsage() {
+	fprintf(stderr, "USAGE: ./pcc_client [-n REQUESTS] <HOST> <PORT> <LENGTH>\n"
+			"       ./pcc_client -c CONNECTIONS [-d SECONDS] [-R REQUESTS_PER_SECOND] [-D fixed|uniform|exponential] <HOST> <PORT> <LENGTH>\n");
+}
+
+int main(int argc, char* argv[]) {
+	uint64_t numberOfRequests = 0; // 0 for a single version 1 request
+	int option;
+	while ((option = getopt(argc, argv, "n:c:d:R:D:")) != -1) {
+		switch (option) {
+			case 'n':
+				numberOfRequests = strtoull(optarg, NULL, 10);
+				break;
+			case 'c':
+				numberOfConnections = atoi(optarg);
+				break;
+			case 'd':
+				duration = atof(optarg);
+				break;
+			case 'R':
+				rate = atof(optarg);
+				break;
+			case 'D':
+				if (!strcmp(optarg, "fixed")) {
+					distribution = DISTRIBUTION_FIXED;
+				}
+				else if (!strcmp(optarg, "uniform")) {
+					distribution = DISTRIBUTION_UNIFORM;
+				}
+				else if (!strcmp(optarg, "exponential")) {
+					distribution = DISTRIBUTION_EXPONENTIAL;
+				}
+				else {
+					printUsage();
+					return 1;
+				}
+				break;
+			default:
+				printUsage();
+				return 1;
+		}
+	}
+	if (argc - optind != 3 || numberOfConnections < 0 || duration <= 0 || rate < 0) {
+		printUsage();
+		return 1;
+	}
+	argv += optind - 1; // So the positional arguments are where they always were
+
+	uint16_t serverPort = (unsigned int) atoi(argv[2]);
+	uint64_t length = strtoull(argv[3], NULL, 10);
+	if (numberOfConnections && distribution != DISTRIBUTION_FIXED && !length) {
+		fprintf(stderr, "pcc_client: LENGTH must be at least 1 for uniform and exponential lengths\n");
+		return 1;
+	}
+	if (numberOfConnections && rate > 0) {
+		interval = (uint64_t) (1e9 * numberOfConnections / rate);
+		if (!interval) { // Faster than that, and they'd all be due at once anyway
+			interval = 1;
+		}
+	}
+	if (!numberOfRequests && length >= PCC_V2_ESCAPE) { // Doesn't fit version 1
+		numberOfRequests = 1;
 	}
 
 	struct sockaddr_in serverAddress;
@@ -60,24 +598,15 @@ int main(int argc, char* argv[]) {
 		serverAddress.sin_addr.s_addr = sockAddress->sin_addr.s_addr;
 	}
 
-	if (connect(sock, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) < 0) {
-		perror("pcc_client: Could not connect to server");
-		return errno;
+	if (numberOfConnections) {
+		meanLength = length;
+		return runLoad(&serverAddress);
 	}
 
-	uint32_t networkLength = htonl(length);
-	char* byteLength = (char*) &networkLength;
-	int size = sizeof(networkLength);
-	int sent;
-	do {
-		if ((sent = write(sock, byteLength, size)) < 0) {
-			perror("pcc_client: Could not send message length to server");
-			return errno;
-		}
-
-		byteLength += sent;
-		size -= sent;
-	} while (size > 0);
+	int sock;
+	if ((sock = connectToServer(&serverAddress)) < 0) {
+		return errno;
+	}
 
 	int urandomDescriptor = open("/dev/urandom", O_RDONLY);
 	if (urandomDescriptor == -1) {
@@ -85,46 +614,11 @@ int main(int argc, char* argv[]) {
 		return errno;
 	}
 
-	int toRead;
-	char* sendBuffer;
-	do {
-		toRead = length > BUFFER_SIZE ? BUFFER_SIZE : length;
-		length -= toRead;
-		if (read(urandomDescriptor, buffer, toRead) != toRead) {
-			perror("pcc_client: Could not read from /dev/urandom");
-			return errno;
-		}
-
-		sendBuffer = buffer;
-		do {
-			if ((sent = write(sock, sendBuffer, toRead)) < 0) {
-				perror("pcc_client: Could not send message to server");
-				return errno;
-			}
-			
-			sendBuffer += sent;
-			toRead -= sent;
-		} while (toRead > 0);
-	} while (length > 0);
-
-	uint32_t C;
-	char* ret = (char*) &C;
-	size = sizeof(C);
-	do {
-		if ((sent = read(sock, ret, size)) < 0) {
-			perror("pcc_client: Could not read message from server");
-			return errno;
-		}
-		
-		ret += sent;
-		size -= sent;
-	} while (size > 0);
-
-	printf("# of printable characters: %u\n", ntohl(C));
+	int result = numberOfRequests ? runVersion2(sock, urandomDescriptor, length, numberOfRequests)
+			: runVersion1(sock, urandomDescriptor, (uint32_t) length);
 
 	close(urandomDescriptor);
 	close(sock);
-	free(buffer);
 
-	return 0;
+	return result;
 }
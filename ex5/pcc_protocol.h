@@ -0,0 +1,29 @@
+#ifndef _PCC_PROTOCOL_H
+#define _PCC_PROTOCOL_H
+
+/***
+ * Version 1: the client sends a 4 byte big endian length N and N bytes, the server
+ * answers with a 4 byte big endian count of the printable ones and closes the connection.
+ *
+ * Version 2 is asked for by sending the escape length followed by the magic - an old
+ * server just sees a (4GB) version 1 payload, and a new server falls back to exactly
+ * that if the magic doesn't follow. The server acknowledges with the magic, then
+ * any number of requests can be pipelined on the connection:
+ *   request:  8 byte sequence, 8 byte length N, N bytes of payload
+ *   response: 8 byte sequence, 8 byte count
+ * All big endian. Responses come back in request order, echoing the client's
+ * sequence. The client half-closes when it's done sending, the server closes after
+ * the last response.
+ */
+
+#define PCC_V2_ESCAPE 0xFFFFFFFFU
+#define PCC_V2_MAGIC "PCC2"
+#define PCC_V2_MAGIC_SIZE 4
+#define PCC_V2_HEADER_SIZE 16
+#define PCC_V2_RESPONSE_SIZE 16
+
+#define NUMBER_OF_PRINTABLE_CHARS 95
+#define FIRST_PRINTABLE_CHAR 32
+#define LAST_PRINTABLE_CHAR 126
+
+#endif
@@ -1,167 +1,1252 @@
+#define _GNU_SOURCE
+#include "count.h"
+#include "pcc_protocol.h"
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#define NUMBER_OF_PRINTABLE_CHARS 95
-#define BUFFER_SIZE 1024
+#define DEFAULT_BUFFER_SIZE (256 * 1024) // One syscall per this much payload, at best
+#define MAXIMUM_EVENTS 64
+#define ACCEPT_RETRY_INTERVAL 100 // Milliseconds the listener's left alone after running out of descriptors
+#define ACCEPT_ERROR_INTERVAL 1 // Seconds between complaints about it, per worker
+#define READS_PER_EVENT 16 // Then the rest of the worker's connections get a turn - epoll's level-triggered, it'll be back
+#define DEFAULT_BACKLOG 10
+#define RATE_INTERVAL 1000 // Milliseconds between the samples rates are taken over
+#define DEFAULT_SNAPSHOT_INTERVAL 60 // Seconds
 
-sig_atomic_t threadCount = 0;
-pthread_mutex_t mutex;
-unsigned int printableCharCounts[NUMBER_OF_PRINTABLE_CHARS];
+#define SEQLOCK_RETRIES (1 << 20) // A writer process that died mid-update never finishes it
+#define MINIMUM_PROCESS_LIFETIME 1 // Seconds - a worker process dying sooner won't do better respawned
 
+#define SNAPSHOT_MAGIC "PCCSNAP1"
+#define SNAPSHOT_MAGIC_SIZE 8
+
+#define OUTPUT_BUFFER_SIZE 1024 // Queued responses - reading pauses while there's no room for another
+
+#define STATE_LENGTH 0 // Reading the 4 byte (version 1) length header
+#define STATE_MAGIC 1 // Got the escape length, is it version 2?
+#define STATE_REQUEST 2 // Reading a version 2 request header
+#define STATE_PAYLOAD 3 // Counting the payload
+#define STATE_CLOSING 4 // Nothing more to read, close once the output's out
+
+typedef struct connection_t {
+	int socket;
+	int state;
+	int version;
+	unsigned char header[PCC_V2_HEADER_SIZE];
+	int headerBytes;
+	uint64_t sequence; // Of the current request
+	uint64_t bytesLeft; // Of the payload
+	uint64_t byteCounts[256]; // Of the current request, its printable ones merged into the worker's shard
+	unsigned char output[OUTPUT_BUFFER_SIZE];
+	int outputStart;
+	int outputEnd;
+	uint64_t length; // Of the current payload
+	uint32_t events; // What epoll's watching for
+	int lowWatermark; // SO_RCVLOWAT currently set on the socket, 0 if untouched
+	double clockStart; // When the current message started, or the last one ended - for the read deadline
+	struct connection_t* previous; // In the worker's list, earliest deadline first
+	struct connection_t* next;
+} Connection;
+
+typedef struct snapshot_t { // All uint64_t, copied word by word
+	uint64_t printableCharCounts[NUMBER_OF_PRINTABLE_CHARS];
+	uint64_t connections; // Accepted
+	uint64_t requests; // Answered
+	uint64_t bytes; // Of payload counted
+	uint64_t rejectedConnections; // Over maximumConnections
+	uint64_t rejectedPayloads; // Over maximumPayload
+	uint64_t timedOut; // Past the read deadline
+} Snapshot;
+
+typedef struct shard_t { // Written only by its worker, summed up by readers
+	uint64_t sequence; // Seqlock - odd while the worker's in the middle of an update
+	Snapshot totals;
+} __attribute__((aligned(64))) Shard; // Own cache lines, no false sharing between workers
+
+typedef struct worker_t {
+	pthread_t thread;
+	int epoll;
+	int listener; // Own SO_REUSEPORT socket, the kernel balances connections between them
+	Shard* shard;
+	unsigned char* buffer; // bufferSize bytes
+	Connection* connections; // All of this worker's, for draining and deadlines
+	Connection* lastConnection;
+	int numberOfConnections;
+	int stopping;
+	int listenerPaused; // Out of descriptors - not watched until a connection closes, or acceptRetry
+	double acceptRetry;
+	double lastAcceptError;
+} Worker;
+
+int* connectionCounts; // Connections in progress, per process, atomically
+int* activeConnections; // This process's
+Shard* shards; // Shared with worker processes in prefork mode
+int numberOfShards;
+int numberOfProcesses = 0; // Prefork mode if > 0
+int workersPerProcess;
+pid_t* processes;
+double* processStarts;
+int childEvents = -1; // signalfd for SIGCHLD, prefork mode's parent only
+uint16_t serverPort;
+int bufferSize = DEFAULT_BUFFER_SIZE; // Per worker - payload is counted straight out of it
+int receiveBufferSize = 0; // SO_RCVBUF, 0 for the kernel's default
+int lowWatermark = 0; // SO_RCVLOWAT for payloads, 0 to wake up on every byte
+int shutdownEvent; // eventfd, readable (for everyone, nobody reads it) once SIGINT came
+char* adminPath = NULL; // Unix socket answering with a stats snapshot, if any
+int maximumConnections = 0; // Over all workers, 0 for no limit
+uint64_t maximumPayload = 0; // 0 for no limit
+double readTimeout = 0; // Seconds a connection gets to send each message, or to start the next one, 0 for never
+int backlog = DEFAULT_BACKLOG; // Of each listener
+char* snapshotPath = NULL; // Where the totals are saved, and loaded from on startup
+double snapshotInterval = DEFAULT_SNAPSHOT_INTERVAL;
+
+double seconds() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/***
+ * A worker brackets its updates with these. Readers retry if the sequence was odd
+ * or moved while they were copying, so they never see half an update, and the
+ * worker never waits for them.
+ */
+void beginUpdate(Shard* shard) {
+	__atomic_store_n(&shard->sequence, shard->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void endUpdate(Shard* shard) {
+	__atomic_store_n(&shard->sequence, shard->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void addToShard(uint64_t* counter, uint64_t value) {
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+void readShard(Shard* shard, Snapshot* snapshot) {
+	uint64_t* words = (uint64_t*) snapshot;
+	uint64_t* shardWords = (uint64_t*) &shard->totals;
+	uint64_t before, after;
+	for (int attempt = 0; attempt < SEQLOCK_RETRIES; attempt++) { // Then make do with what there is
+		if ((before = __atomic_load_n(&shard->sequence, __ATOMIC_ACQUIRE)) & 1) { // Mid-update
+			continue;
+		}
+		for (size_t i = 0; i < sizeof(Snapshot) / sizeof(uint64_t); i++) {
+			words[i] = __atomic_load_n(&shardWords[i], __ATOMIC_RELAXED);
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&shard->sequence, __ATOMIC_RELAXED);
+		if (before == after) {
+			return;
+		}
+	}
+
+	for (size_t i = 0; i < sizeof(Snapshot) / sizeof(uint64_t); i++) {
+		words[i] = __atomic_load_n(&shardWords[i], __ATOMIC_RELAXED);
+	}
+}
+
+/***
+ * Over all processes - each keeps its own count, so a dead one's can just be zeroed.
+ */
+int totalActiveConnections() {
+	int total = 0;
+	for (int i = 0; i < (numberOfProcesses ? numberOfProcesses : 1); i++) {
+		total += __atomic_load_n(&connectionCounts[i], __ATOMIC_SEQ_CST);
+	}
+
+	return total;
+}
+
+/***
+ * Sums up all the shards, each one as of some point between two of its updates.
+ */
+void mergeShards(Snapshot* snapshot) {
+	Snapshot shard;
+	uint64_t* words = (uint64_t*) snapshot;
+	uint64_t* shardWords = (uint64_t*) &shard;
+	memset(snapshot, 0, sizeof(Snapshot));
+	for (int i = 0; i < numberOfShards; i++) {
+		readShard(&shards[i], &shard);
+		for (size_t j = 0; j < sizeof(Snapshot) / sizeof(uint64_t); j++) {
+			words[j] += shardWords[j];
+		}
+	}
+}
+
+void printHistogram(FILE* file, Snapshot* snapshot) {
+	for (int i = 0; i < NUMBER_OF_PRINTABLE_CHARS; i++) {
+		fprintf(file, "char '%c' : %llu times\n", i + FIRST_PRINTABLE_CHAR, (unsigned long long) snapshot->printableCharCounts[i]);
+	}
+}
+
+/***
+ * Only flags it - the workers drain, and main prints the histogram once they're done.
+ */
 void sigIntHandler(int signal) {
 	if (signal == SIGINT) {
-		while (threadCount > 0) {
-			sleep(1);
+		uint64_t one = 1;
+		if (write(shutdownEvent, &one, sizeof(one)) < 0) { // Can't do much about it in here
+			return;
+		}
+	}
+}
+
+/***
+ * Every listener's SO_REUSEPORT, so another server already on the port would happily
+ * share it with us - and take half the connections. A plain bind says if it's taken.
+ */
+void checkPortFree() {
+	int sock, enable = 1;
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("pcc_server: Could not create socket");
+		exit(errno);
+	}
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1) { // Connections of a server that's gone don't count
+		perror("pcc_server: Could not set SO_REUSEADDR");
+		exit(errno);
+	}
+
+	struct sockaddr_in serverAddress;
+	memset(&serverAddress, 0, sizeof(serverAddress));
+	serverAddress.sin_family = AF_INET;
+	serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+	serverAddress.sin_port = htons(serverPort);
+	if (bind(sock, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) == -1) {
+		perror(errno == EADDRINUSE ? "pcc_server: Port is already in use" : "pcc_server: Could not bind address");
+		exit(1);
+	}
+	close(sock);
+}
+
+int createListener() {
+	int sock;
+	if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+		perror("pcc_server: Could not create socket");
+		exit(errno);
+	}
+
+	int enable = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1) {
+		perror("pcc_server: Could not set SO_REUSEPORT");
+		exit(errno);
+	}
+	// Our connections inherit it, so the ones left in TIME_WAIT don't fail checkPortFree on a restart
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1) {
+		perror("pcc_server: Could not set SO_REUSEADDR");
+		exit(errno);
+	}
+
+	// Set before listen(), so accepted sockets inherit it and the window scale is negotiated with it
+	if (receiveBufferSize && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &receiveBufferSize, sizeof(receiveBufferSize)) == -1) {
+		perror("pcc_server: Could not set SO_RCVBUF");
+		exit(errno);
+	}
+
+	struct sockaddr_in serverAddress;
+	memset(&serverAddress, 0, sizeof(serverAddress));
+	serverAddress.sin_family = AF_INET;
+	serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+	serverAddress.sin_port = htons(serverPort);
+
+	if (bind(sock, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) == -1) {
+		perror("pcc_server: Could not bind address");
+		exit(1);
+	}
+
+	if (listen(sock, backlog) == -1) {
+		perror("pcc_server: Could not listen for connections");
+		exit(1);
+	}
+
+	return sock;
+}
+
+void unlinkConnection(Worker* worker, Connection* connection) {
+	if (connection->previous) {
+		connection->previous->next = connection->next;
+	}
+	else {
+		worker->connections = connection->next;
+	}
+	if (connection->next) {
+		connection->next->previous = connection->previous;
+	}
+	else {
+		worker->lastConnection = connection->previous;
+	}
+}
+
+void appendConnection(Worker* worker, Connection* connection) {
+	connection->next = NULL;
+	if ((connection->previous = worker->lastConnection)) {
+		connection->previous->next = connection;
+	}
+	else {
+		worker->connections = connection;
+	}
+	worker->lastConnection = connection;
+}
+
+/***
+ * Starts the connection's clock over - to the back of the list, so the list stays in
+ * deadline order.
+ */
+void restartClock(Worker* worker, Connection* connection) {
+	connection->clockStart = seconds();
+	if (worker->lastConnection != connection) {
+		unlinkConnection(worker, connection);
+		appendConnection(worker, connection);
+	}
+}
+
+/***
+ * A connection accept couldn't take (out of descriptors or memory) stays in the
+ * backlog, so the level-triggered listener would have epoll_wait back for it right
+ * away, over and over. It's left out of the watch until a connection of ours closes
+ * and frees one up, or ACCEPT_RETRY_INTERVAL's passed - other workers' may have.
+ */
+void watchListener(Worker* worker, int watch) {
+	struct epoll_event event;
+	event.events = watch ? EPOLLIN : 0;
+	event.data.ptr = NULL; // Marks the listener
+	if (epoll_ctl(worker->epoll, EPOLL_CTL_MOD, worker->listener, &event) == -1) {
+		perror("pcc_server: Could not watch listener");
+		exit(errno);
+	}
+	worker->listenerPaused = !watch;
+	worker->acceptRetry = seconds() + ACCEPT_RETRY_INTERVAL / 1000.0;
+}
+
+void closeConnection(Worker* worker, Connection* connection) {
+	epoll_ctl(worker->epoll, EPOLL_CTL_DEL, connection->socket, NULL);
+	close(connection->socket);
+	unlinkConnection(worker, connection);
+	worker->numberOfConnections--;
+	free(connection);
+	__atomic_fetch_sub(activeConnections, 1, __ATOMIC_RELEASE);
+	if (worker->listenerPaused && !worker->stopping) { // One descriptor free, at least
+		watchListener(worker, 1);
+	}
+}
+
+int isBetweenMessages(Connection* connection) {
+	return (connection->state == STATE_LENGTH || connection->state == STATE_REQUEST) && !connection->headerBytes;
+}
+
+/***
+ * Whether the connection's between messages, so closing it loses nothing.
+ */
+int isIdle(Connection* connection) {
+	return isBetweenMessages(connection) && connection->outputStart == connection->outputEnd;
+}
+
+/***
+ * Hangs up with a reset - no FIN_WAIT or TIME_WAIT left behind for connections we
+ * never wanted.
+ */
+void rejectConnection(int sock) {
+	struct linger linger = { 1, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	close(sock);
+}
+
+void countRejection(Shard* shard, uint64_t* counter) {
+	beginUpdate(shard);
+	addToShard(counter, 1);
+	endUpdate(shard);
+}
+
+void acceptConnections(Worker* worker) {
+	int sock;
+	while ((sock = accept4(worker->listener, NULL, NULL, SOCK_NONBLOCK)) >= 0) { // Until there are none waiting
+		// Claim a place first, then count everyone's - two workers (or processes) racing for
+		// the last place may both lose it, but they can't both get it
+		__atomic_fetch_add(activeConnections, 1, __ATOMIC_SEQ_CST);
+		if (maximumConnections && totalActiveConnections() > maximumConnections) {
+			__atomic_fetch_sub(activeConnections, 1, __ATOMIC_RELAXED);
+			rejectConnection(sock);
+			countRejection(worker->shard, &worker->shard->totals.rejectedConnections);
+			continue;
+		}
+
+		Connection* connection = (Connection*) calloc(1, sizeof(Connection));
+		if (!connection) {
+			perror("pcc_server: Could not allocate connection");
+			rejectConnection(sock);
+			__atomic_fetch_sub(activeConnections, 1, __ATOMIC_RELAXED);
+			continue;
 		}
+		connection->socket = sock;
+		connection->state = STATE_LENGTH;
+		connection->version = 1;
+		connection->events = EPOLLIN;
 
-		printf("\n");
-		for (int i = 0; i < NUMBER_OF_PRINTABLE_CHARS; i++) {
-			printf("char '%c' : %u times\n", i + 32, printableCharCounts[i]);
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = connection;
+		if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, sock, &event) == -1) {
+			perror("pcc_server: Could not watch connection");
+			rejectConnection(sock);
+			free(connection);
+			__atomic_fetch_sub(activeConnections, 1, __ATOMIC_RELAXED);
+			continue;
 		}
+		connection->clockStart = seconds();
+		appendConnection(worker, connection);
+		worker->numberOfConnections++;
 
-		fflush(stdout);
+		beginUpdate(worker->shard);
+		addToShard(&worker->shard->totals.connections, 1);
+		endUpdate(worker->shard);
+	}
 
-		exit(0);
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+		return;
+	}
+	int error = errno;
+	if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM) {
+		watchListener(worker, 0);
+	}
+	if (seconds() - worker->lastAcceptError >= ACCEPT_ERROR_INTERVAL) { // Whatever it is, it'll likely happen again
+		worker->lastAcceptError = seconds();
+		errno = error;
+		perror("pcc_server: Failed to accept connection");
 	}
 }
 
-void* threadFunction(void* thread_param) {
-	threadCount++;
-	int connection = *(int*) thread_param;
-	unsigned int threadPrintableCharCounts[NUMBER_OF_PRINTABLE_CHARS];
-	for (int i = 0; i < NUMBER_OF_PRINTABLE_CHARS; i++) {
-		threadPrintableCharCounts[i] = 0;
-	}
-	int printableCharsCount = 0;
-	char buffer[BUFFER_SIZE];
-
-	uint32_t N;
-	char* length = (char*) &N;
-	int size = sizeof(N);
-	int receivedBytes;
-	do {
-		if ((receivedBytes = read(connection, length, size)) < 0) {
-			perror("pcc_server: Could not read message length from client");
-			exit(errno);
+/***
+ * With a low watermark, epoll only reports the socket once that many bytes are waiting,
+ * so a big payload is read in big chunks instead of as each segment lands. It's lowered
+ * as the payload runs out, so the last few bytes still wake us up.
+ */
+void setLowWatermark(Connection* connection) {
+	int watermark = connection->state == STATE_PAYLOAD && connection->bytesLeft < (uint64_t) lowWatermark
+			? (int) connection->bytesLeft : lowWatermark;
+	if (connection->state != STATE_PAYLOAD || !watermark) {
+		watermark = 1; // The default
+	}
+
+	if (watermark != connection->lowWatermark && (connection->lowWatermark || watermark > 1)) {
+		if (setsockopt(connection->socket, SOL_SOCKET, SO_RCVLOWAT, &watermark, sizeof(watermark)) == -1) {
+			perror("pcc_server: Could not set SO_RCVLOWAT");
+			return;
 		}
-		
-		length += receivedBytes;
-		size -= receivedBytes;
-	} while (size > 0);
+		connection->lowWatermark = watermark;
+	}
+}
 
-	N = ntohl(N);
+void queueOutput(Connection* connection, const void* data, int length) {
+	if (connection->outputEnd + length > OUTPUT_BUFFER_SIZE) { // Slide what's left to the front
+		memmove(connection->output, connection->output + connection->outputStart, connection->outputEnd - connection->outputStart);
+		connection->outputEnd -= connection->outputStart;
+		connection->outputStart = 0;
+	}
+
+	memcpy(connection->output + connection->outputEnd, data, length);
+	connection->outputEnd += length;
+}
+
+int outputRoom(Connection* connection) {
+	return OUTPUT_BUFFER_SIZE - (connection->outputEnd - connection->outputStart);
+}
+
+void finishPayload(Shard* shard, Connection* connection) {
+	uint64_t printableCharsCount = 0;
+	beginUpdate(shard); // Our shard, no one else writes it
+	for (int i = 0; i < NUMBER_OF_PRINTABLE_CHARS; i++) {
+		uint64_t count = connection->byteCounts[i + FIRST_PRINTABLE_CHAR];
+		addToShard(&shard->totals.printableCharCounts[i], count);
+		printableCharsCount += count;
+	}
+	addToShard(&shard->totals.requests, 1);
+	addToShard(&shard->totals.bytes, connection->length);
+	endUpdate(shard);
+	memset(connection->byteCounts, 0, sizeof(connection->byteCounts));
+
+	if (connection->version == 1) { // One and done
+		uint32_t networkCount = htonl((uint32_t) printableCharsCount);
+		queueOutput(connection, &networkCount, sizeof(networkCount));
+		connection->state = STATE_CLOSING;
+	}
+	else { // Answer, and on to the next request
+		uint64_t response[2] = { htobe64(connection->sequence), htobe64(printableCharsCount) };
+		queueOutput(connection, response, sizeof(response));
+		connection->state = STATE_REQUEST;
+	}
+}
 
-	do {
-		int toReceive = N > BUFFER_SIZE ? BUFFER_SIZE : N;
-		if ((receivedBytes = read(connection, buffer, toReceive)) < 0) {
+void countPayload(Connection* connection, const unsigned char* data, size_t length) {
+	countHistogram(data, length, connection->byteCounts);
+	connection->bytesLeft -= length;
+}
+
+/***
+ * Returns -1 if the payload's over the limit - there's no way to say no in the
+ * protocol, so the connection's just dropped.
+ */
+int startPayload(Shard* shard, Connection* connection, uint64_t length) {
+	if (maximumPayload && length > maximumPayload) {
+		countRejection(shard, &shard->totals.rejectedPayloads);
+		return -1;
+	}
+
+	connection->bytesLeft = connection->length = length;
+	connection->state = STATE_PAYLOAD;
+	if (!length) {
+		finishPayload(shard, connection);
+	}
+
+	return 0;
+}
+
+/***
+ * A header (of whichever kind the state calls for) is complete - act on it.
+ * Returns -1 if the connection should be dropped.
+ */
+int finishHeader(Shard* shard, Connection* connection) {
+	uint32_t length;
+	uint64_t request[2];
+	connection->headerBytes = 0;
+
+	switch (connection->state) {
+		case STATE_LENGTH:
+			memcpy(&length, connection->header, sizeof(length));
+			if (ntohl(length) == PCC_V2_ESCAPE) { // Maybe version 2
+				connection->state = STATE_MAGIC;
+			}
+			else {
+				return startPayload(shard, connection, ntohl(length));
+			}
+			break;
+		case STATE_MAGIC:
+			if (!memcmp(connection->header, PCC_V2_MAGIC, PCC_V2_MAGIC_SIZE)) {
+				connection->version = 2;
+				connection->state = STATE_REQUEST;
+				queueOutput(connection, PCC_V2_MAGIC, PCC_V2_MAGIC_SIZE); // Acknowledge
+			}
+			else { // Just a version 1 client with a really long message, and that was its start
+				if (startPayload(shard, connection, PCC_V2_ESCAPE) < 0) {
+					return -1;
+				}
+				countPayload(connection, connection->header, PCC_V2_MAGIC_SIZE);
+			}
+			break;
+		case STATE_REQUEST:
+			memcpy(request, connection->header, sizeof(request));
+			connection->sequence = be64toh(request[0]);
+			return startPayload(shard, connection, be64toh(request[1]));
+	}
+
+	return 0;
+}
+
+int headerSize(Connection* connection) {
+	return connection->state == STATE_REQUEST ? PCC_V2_HEADER_SIZE : 4;
+}
+
+/***
+ * Reads whatever's available, moving along the states, until the socket would block,
+ * there's no room left to queue another response, or it's had READS_PER_EVENT reads.
+ * Returns -1 if the connection should be dropped.
+ */
+int receive(Worker* worker, Connection* connection, unsigned char* buffer) {
+	ssize_t receivedBytes;
+	for (int reads = 0; reads < READS_PER_EVENT && connection->state != STATE_CLOSING
+			&& outputRoom(connection) >= PCC_V2_RESPONSE_SIZE; reads++) {
+		if (connection->state == STATE_PAYLOAD) {
+			receivedBytes = recv(connection->socket, buffer,
+					connection->bytesLeft > (uint64_t) bufferSize ? (size_t) bufferSize : (size_t) connection->bytesLeft, 0);
+		}
+		else {
+			receivedBytes = recv(connection->socket, connection->header + connection->headerBytes,
+					headerSize(connection) - connection->headerBytes, 0);
+		}
+
+		if (receivedBytes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (lowWatermark) {
+					setLowWatermark(connection);
+				}
+				return 0;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
 			perror("pcc_server: Could not read message from client");
-			exit(errno);
+			return -1;
+		}
+		if (!receivedBytes) {
+			if (connection->state == STATE_REQUEST && !connection->headerBytes) { // Between requests, all good
+				connection->state = STATE_CLOSING;
+				return 0;
+			}
+			fprintf(stderr, "pcc_server: Client closed connection mid-message\n");
+			return -1;
 		}
 
-		for (int i = 0; i < receivedBytes; i++) {
-			if (buffer[i] >= 32 && buffer[i] <= 126) {
-				threadPrintableCharCounts[buffer[i] - 32]++;
-				printableCharsCount++;
+		// The clock only starts over when a message does, and when it's done - a client
+		// dribbling a byte at a time still has to get the whole message in on time
+		int starting = isBetweenMessages(connection);
+		if (connection->state == STATE_PAYLOAD) {
+			countPayload(connection, buffer, receivedBytes);
+			if (!connection->bytesLeft) {
+				finishPayload(worker->shard, connection);
 			}
 		}
+		else if ((connection->headerBytes += receivedBytes) == headerSize(connection)
+				&& finishHeader(worker->shard, connection) < 0) {
+			return -1;
+		}
+		if (readTimeout && (starting || isBetweenMessages(connection))) {
+			restartClock(worker, connection);
+		}
+	}
+
+	return 0;
+}
 
-		N -= receivedBytes;
-	} while (N > 0);
+/***
+ * Sends as much of the queued output as the socket takes. Returns -1 on errors.
+ */
+int flush(Connection* connection) {
+	ssize_t sent;
+	while (connection->outputStart < connection->outputEnd) {
+		sent = send(connection->socket, connection->output + connection->outputStart,
+				connection->outputEnd - connection->outputStart, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("pcc_server: Could not send count to client");
+			return -1;
+		}
 
-	if (pthread_mutex_lock(&mutex)) {
-		perror("pcc_server: Could not lock mutex");
-		exit(errno);
+		connection->outputStart += sent;
 	}
 
-	for (int i = 0; i < NUMBER_OF_PRINTABLE_CHARS; i++) {
-		printableCharCounts[i] += threadPrintableCharCounts[i];
+	connection->outputStart = connection->outputEnd = 0;
+	return 0;
+}
+
+void handleConnection(Worker* worker, Connection* connection) {
+	if (receive(worker, connection, worker->buffer) < 0 || flush(connection) < 0) {
+		closeConnection(worker, connection);
+		return;
 	}
 
-	if (pthread_mutex_unlock(&mutex)) {
-		perror("pcc_server: Could not unlock mutex");
-		exit(errno);
+	if (worker->stopping && isIdle(connection)) { // Shutting down, and this one's done with its message
+		connection->state = STATE_CLOSING;
 	}
 
-	uint32_t networkCount = htonl(printableCharsCount);
-	char* byteCount = (char*) &networkCount;
-	size = sizeof(networkCount);
-	int sent;
-	do {
-		if ((sent = write(connection, byteCount, size)) < 0) {
-			perror("pcc_server: Could not send count to client");
+	int pending = connection->outputStart < connection->outputEnd;
+	if (connection->state == STATE_CLOSING && !pending) { // Said all there is to say
+		closeConnection(worker, connection);
+		return;
+	}
+
+	// Read while there's room for the answers, write while there are answers waiting
+	uint32_t events = (connection->state != STATE_CLOSING && outputRoom(connection) >= PCC_V2_RESPONSE_SIZE ? EPOLLIN : 0)
+			| (pending ? EPOLLOUT : 0);
+	if (events != connection->events) {
+		struct epoll_event event;
+		event.events = events;
+		event.data.ptr = connection;
+		if (epoll_ctl(worker->epoll, EPOLL_CTL_MOD, connection->socket, &event) == -1) {
+			perror("pcc_server: Could not watch connection");
+			closeConnection(worker, connection);
+			return;
+		}
+		connection->events = events;
+	}
+}
+
+/***
+ * Stops accepting, and lets go of connections that are between messages. The rest
+ * get to finish the message they're on.
+ */
+void startDraining(Worker* worker) {
+	worker->stopping = 1;
+	epoll_ctl(worker->epoll, EPOLL_CTL_DEL, shutdownEvent, NULL);
+	epoll_ctl(worker->epoll, EPOLL_CTL_DEL, worker->listener, NULL);
+	close(worker->listener);
+
+	Connection* next;
+	for (Connection* connection = worker->connections; connection; connection = next) {
+		next = connection->next;
+		if (isIdle(connection)) {
+			closeConnection(worker, connection);
+		}
+	}
+}
+
+/***
+ * Drops connections past the read deadline (see receive) - they're at the front of the list.
+ * Returns how many milliseconds until the next one's due, -1 if none is.
+ */
+int expireConnections(Worker* worker) {
+	double now = seconds();
+	while (worker->connections && worker->connections->clockStart + readTimeout <= now) {
+		countRejection(worker->shard, &worker->shard->totals.timedOut);
+		closeConnection(worker, worker->connections);
+	}
+
+	return worker->connections ? (int) ((worker->connections->clockStart + readTimeout - now) * 1000) + 1 : -1;
+}
+
+void* threadFunction(void* thread_param) {
+	Worker* worker = (Worker*) thread_param;
+	struct epoll_event events[MAXIMUM_EVENTS];
+	int timeout = -1;
+
+	while (!worker->stopping || worker->numberOfConnections > 0) {
+		int numberOfEvents = epoll_wait(worker->epoll, events, MAXIMUM_EVENTS, timeout);
+		if (numberOfEvents < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("pcc_server: Could not wait for events");
 			exit(errno);
 		}
 
-		byteCount += sent;
-		size -= sent;
-	} while (size > 0);
+		int drain = 0;
+		for (int i = 0; i < numberOfEvents; i++) {
+			if (events[i].data.ptr == &shutdownEvent) {
+				drain = 1; // After this batch, which may still point at connections draining would close
+			}
+			else if (!events[i].data.ptr) { // The listener
+				if (!worker->stopping) {
+					acceptConnections(worker);
+				}
+			}
+			else {
+				handleConnection(worker, (Connection*) events[i].data.ptr);
+			}
+		}
+		if (drain) {
+			startDraining(worker);
+		}
+		if (worker->listenerPaused && !worker->stopping && seconds() >= worker->acceptRetry) {
+			watchListener(worker, 1);
+		}
+		timeout = readTimeout ? expireConnections(worker) : -1;
+		if (worker->listenerPaused && (timeout < 0 || timeout > ACCEPT_RETRY_INTERVAL)) {
+			timeout = ACCEPT_RETRY_INTERVAL;
+		}
+	}
 
-	close(connection);
-	threadCount--;
 	return (void*) 0;
 }
 
-int main(int argc, char* argv[]) {
-	if (signal(SIGINT, sigIntHandler) == SIG_ERR) {
-		perror("pcc_server: Could not register signal handler");
-		return 1;
+int createAdminListener() {
+	int sock;
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+		perror("pcc_server: Could not create admin socket");
+		exit(errno);
 	}
-	for (int i = 0; i < NUMBER_OF_PRINTABLE_CHARS; i++) {
-		printableCharCounts[i] = 0;
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(adminPath) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "pcc_server: Admin socket path is too long\n");
+		exit(1);
 	}
-	uint16_t serverPort = (unsigned int) atoi(argv[1]);
+	strcpy(address.sun_path, adminPath);
+	unlink(adminPath); // Left over from a server that didn't get to clean up
 
-	if (pthread_mutex_init(&mutex, NULL)) { // Init mutex
-		perror("pcc_server: Could not initialize mutex");
-		return 1;
+	if (bind(sock, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(sock, DEFAULT_BACKLOG) == -1) {
+		perror("pcc_server: Could not listen on admin socket");
+		exit(1);
 	}
 
+	return sock;
+}
+
+/***
+ * Answers everyone waiting on the admin socket with a snapshot, and hangs up.
+ */
+void answerAdmins(int adminListener, double connectionsPerSecond, double bytesPerSecond) {
 	int sock;
-	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("pcc_server: Could not create socket");
-		return errno;
+	while ((sock = accept(adminListener, NULL, NULL)) >= 0) {
+		struct timeval timeout = { 1, 0 }; // A stuck reader doesn't get to stall us
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		FILE* file = fdopen(sock, "w");
+		if (!file) {
+			perror("pcc_server: Could not answer admin");
+			close(sock);
+			continue;
+		}
+
+		Snapshot snapshot;
+		mergeShards(&snapshot);
+		fprintf(file, "active_connections %d\n", totalActiveConnections());
+		fprintf(file, "connections %llu\n", (unsigned long long) snapshot.connections);
+		fprintf(file, "requests %llu\n", (unsigned long long) snapshot.requests);
+		fprintf(file, "bytes %llu\n", (unsigned long long) snapshot.bytes);
+		fprintf(file, "rejected_connections %llu\n", (unsigned long long) snapshot.rejectedConnections);
+		fprintf(file, "rejected_payloads %llu\n", (unsigned long long) snapshot.rejectedPayloads);
+		fprintf(file, "timed_out %llu\n", (unsigned long long) snapshot.timedOut);
+		fprintf(file, "connections_per_second %.1f\n", connectionsPerSecond);
+		fprintf(file, "bytes_per_second %.1f\n", bytesPerSecond);
+		printHistogram(file, &snapshot);
+		fclose(file);
 	}
+}
 
-	struct sockaddr_in serverAddress;
-	memset(&serverAddress, 0, sizeof(serverAddress));
-	serverAddress.sin_family = AF_INET;
-	serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
-	serverAddress.sin_port = htons(serverPort);
+/***
+ * FNV-1a, over the file's words - enough to catch a torn or corrupt file.
+ */
+uint64_t snapshotChecksum(const uint64_t* words, size_t count) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < count; i++) {
+		for (int j = 0; j < 64; j += 8) {
+			hash ^= (words[i] >> j) & 0xff;
+			hash *= 0x100000001b3ULL;
+		}
+	}
 
-	if (bind(sock, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) == -1) {
-		perror("pcc_server: Could not bind address");
-		return 1;
+	return hash;
+}
+
+/***
+ * The file is the magic, the number of words in a Snapshot, the snapshot and the
+ * checksum of all that, each word little endian. It's written to a temporary file
+ * that's synced and renamed over the old one, so a crash leaves either snapshot
+ * whole, never half of one.
+ */
+void saveSnapshot() {
+	uint64_t words[2 + sizeof(Snapshot) / sizeof(uint64_t) + 1]; // Magic, count, snapshot, checksum
+	size_t count = sizeof(Snapshot) / sizeof(uint64_t);
+	Snapshot snapshot;
+	mergeShards(&snapshot);
+
+	memcpy(&words[0], SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+	words[1] = htole64(count);
+	for (size_t i = 0; i < count; i++) {
+		words[2 + i] = htole64(((uint64_t*) &snapshot)[i]);
 	}
+	words[2 + count] = htole64(snapshotChecksum(words, 2 + count));
 
-	if (listen(sock, 10) == -1) {
-		perror("pcc_server: Could not listen for connections");
-		return 1;
+	char temporaryPath[strlen(snapshotPath) + 5];
+	sprintf(temporaryPath, "%s.tmp", snapshotPath);
+	int file = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file < 0) {
+		perror("pcc_server: Could not create snapshot");
+		return;
+	}
+	if (write(file, words, sizeof(words)) != sizeof(words) || fsync(file) < 0) {
+		perror("pcc_server: Could not write snapshot");
+		close(file);
+		unlink(temporaryPath);
+		return;
+	}
+	close(file);
+
+	if (rename(temporaryPath, snapshotPath) < 0) {
+		perror("pcc_server: Could not replace snapshot");
+		unlink(temporaryPath);
+		return;
 	}
 
-	int connection;
-	pthread_t thread_id;
+	char directoryPath[strlen(snapshotPath) + 1]; // The rename's only durable once the directory is synced
+	strcpy(directoryPath, snapshotPath);
+	int directory = open(dirname(directoryPath), O_RDONLY | O_DIRECTORY);
+	if (directory >= 0) {
+		fsync(directory);
+		close(directory);
+	}
+}
+
+/***
+ * Picks up where the last run's snapshot left off, by starting the first shard at
+ * its totals. No snapshot is a fresh start, a bad one is ignored with a warning.
+ */
+void loadSnapshot() {
+	uint64_t words[2 + sizeof(Snapshot) / sizeof(uint64_t) + 1];
+	size_t count = sizeof(Snapshot) / sizeof(uint64_t);
+	int file = open(snapshotPath, O_RDONLY);
+	if (file < 0) {
+		if (errno != ENOENT) {
+			perror("pcc_server: Could not open snapshot");
+		}
+		return;
+	}
+
+	ssize_t length = read(file, words, sizeof(words));
+	close(file);
+	if (length != sizeof(words) || memcmp(&words[0], SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) || le64toh(words[1]) != count
+			|| le64toh(words[2 + count]) != snapshotChecksum(words, 2 + count)) {
+		fprintf(stderr, "pcc_server: Ignoring invalid snapshot %s\n", snapshotPath);
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++) { // No workers yet, nobody else is looking
+		((uint64_t*) &shards[0].totals)[i] = le64toh(words[2 + i]);
+	}
+}
+
+/***
+ * Sets up count workers on the shards from firstShard on, and starts them.
+ */
+void startWorkers(Worker* workers, int count, Shard* firstShard) {
+	sigset_t signals, oldSignals; // SIGINT is for the main thread only, workers hear of it through shutdownEvent
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &signals, &oldSignals);
+
+	for (int i = 0; i < count; i++) {
+		workers[i].listener = createListener();
+		workers[i].shard = &firstShard[i];
+		if (!(workers[i].buffer = (unsigned char*) malloc(bufferSize))) {
+			perror("pcc_server: Could not allocate receive buffer");
+			exit(1);
+		}
+		if ((workers[i].epoll = epoll_create1(0)) == -1) {
+			perror("pcc_server: Could not create epoll instance");
+			exit(errno);
+		}
+
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = NULL; // Marks the listener
+		if (epoll_ctl(workers[i].epoll, EPOLL_CTL_ADD, workers[i].listener, &event) == -1) {
+			perror("pcc_server: Could not watch listener");
+			exit(errno);
+		}
+		event.data.ptr = &shutdownEvent;
+		if (epoll_ctl(workers[i].epoll, EPOLL_CTL_ADD, shutdownEvent, &event) == -1) {
+			perror("pcc_server: Could not watch shutdown event");
+			exit(errno);
+		}
+
+		if (pthread_create(&workers[i].thread, NULL, threadFunction, (void*) &workers[i])) {
+			perror("pcc_server: Failed to create worker thread");
+			exit(1);
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+}
+
+void joinWorkers(Worker* workers, int count) {
+	for (int i = 0; i < count; i++) { // Draining
+		pthread_join(workers[i].thread, NULL);
+	}
+}
+
+/***
+ * A worker process - its own listeners and workers, on its own slice of the shared
+ * shards. The shutdown eventfd came along through fork(), so the parent's SIGINT
+ * reaches it without any signalling of its own.
+ */
+void spawnProcess(int index) {
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("pcc_server: Could not fork worker process");
+		return;
+	}
+	if (pid > 0) {
+		processes[index] = pid;
+		processStarts[index] = seconds();
+		return;
+	}
+
+	signal(SIGINT, SIG_IGN); // Ctrl-C hits the whole process group, it's the parent's to handle
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &signals, NULL);
+	close(childEvents);
+
+	activeConnections = &connectionCounts[index];
+	Worker* workers = (Worker*) calloc(workersPerProcess, sizeof(Worker));
+	if (!workers) {
+		perror("pcc_server: Could not allocate workers");
+		exit(1);
+	}
+	startWorkers(workers, workersPerProcess, &shards[index * workersPerProcess]);
+	joinWorkers(workers, workersPerProcess);
+	exit(0);
+}
+
+/***
+ * Cleans up after worker processes that are gone - waiting for them if stopping,
+ * respawning them otherwise. Their shards live on in the shared mapping, only what
+ * was in flight is lost. A shard left mid-update gets its seqlock closed as is.
+ */
+void reapProcesses(int stopping) {
+	pid_t pid;
+	int status;
+	while ((pid = waitpid(-1, &status, stopping ? 0 : WNOHANG)) > 0) {
+		int index;
+		for (index = 0; index < numberOfProcesses && processes[index] != pid; index++);
+		if (index == numberOfProcesses) {
+			continue;
+		}
+
+		for (int i = index * workersPerProcess; i < (index + 1) * workersPerProcess; i++) {
+			uint64_t sequence = __atomic_load_n(&shards[i].sequence, __ATOMIC_RELAXED);
+			if (sequence & 1) {
+				__atomic_store_n(&shards[i].sequence, sequence + 1, __ATOMIC_RELEASE);
+			}
+		}
+		__atomic_store_n(&connectionCounts[index], 0, __ATOMIC_RELAXED); // Its connections went with it
+		processes[index] = 0;
+		if (stopping) {
+			continue;
+		}
+
+		if (WIFSIGNALED(status)) {
+			fprintf(stderr, "pcc_server: Worker process %d killed by signal %d\n", (int) pid, WTERMSIG(status));
+		}
+		else {
+			fprintf(stderr, "pcc_server: Worker process %d exited with status %d\n", (int) pid, WEXITSTATUS(status));
+		}
+		if (seconds() - processStarts[index] < MINIMUM_PROCESS_LIFETIME) { // Something's wrong with the setup itself
+			fprintf(stderr, "pcc_server: Worker process died right after starting, shutting down\n");
+			uint64_t one = 1;
+			if (write(shutdownEvent, &one, sizeof(one)) < 0) {
+				perror("pcc_server: Could not signal shutdown");
+				exit(1);
+			}
+			continue;
+		}
+		spawnProcess(index);
+	}
+}
+
+void* allocateShared(size_t size) {
+	void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		perror("pcc_server: Could not allocate shared memory");
+		exit(1);
+	}
+
+	return memory; // Zeroed, and page aligned - so are the shards
+}
+
+/***
+ * Main's own loop, until SIGINT - answers the admin socket, and samples the totals
+ * every RATE_INTERVAL for the rates.
+ */
+void serveAdmin() {
+	int epoll, adminListener = -1;
+	if ((epoll = epoll_create1(0)) == -1) {
+		perror("pcc_server: Could not create epoll instance");
+		exit(errno);
+	}
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = shutdownEvent;
+	if (epoll_ctl(epoll, EPOLL_CTL_ADD, shutdownEvent, &event) == -1) {
+		perror("pcc_server: Could not watch shutdown event");
+		exit(errno);
+	}
+	if (adminPath) {
+		adminListener = createAdminListener();
+		event.data.fd = adminListener;
+		if (epoll_ctl(epoll, EPOLL_CTL_ADD, adminListener, &event) == -1) {
+			perror("pcc_server: Could not watch admin socket");
+			exit(errno);
+		}
+	}
+	if (childEvents >= 0) {
+		event.data.fd = childEvents;
+		if (epoll_ctl(epoll, EPOLL_CTL_ADD, childEvents, &event) == -1) {
+			perror("pcc_server: Could not watch worker processes");
+			exit(errno);
+		}
+	}
+
+	Snapshot snapshot;
+	mergeShards(&snapshot);
+	uint64_t lastConnections = snapshot.connections, lastBytes = snapshot.bytes;
+	double lastSample = seconds(), lastSave = lastSample, connectionsPerSecond = 0, bytesPerSecond = 0;
 	while (1) {
-		connection = accept(sock, NULL, NULL);
-		if (connection < 0) {
-			if (errno == EINTR) {
+		int numberOfEvents = epoll_wait(epoll, &event, 1, RATE_INTERVAL);
+		if (numberOfEvents < 0 && errno != EINTR) {
+			perror("pcc_server: Could not wait for events");
+			exit(errno);
+		}
+
+		double now = seconds();
+		if (now - lastSample >= RATE_INTERVAL / 1000.0) {
+			mergeShards(&snapshot);
+			connectionsPerSecond = (snapshot.connections - lastConnections) / (now - lastSample);
+			bytesPerSecond = (snapshot.bytes - lastBytes) / (now - lastSample);
+			lastConnections = snapshot.connections;
+			lastBytes = snapshot.bytes;
+			lastSample = now;
+		}
+		if (snapshotPath && now - lastSave >= snapshotInterval) { // Workers carry on meanwhile
+			saveSnapshot();
+			lastSave = now;
+		}
+
+		if (numberOfEvents > 0) {
+			if (event.data.fd == shutdownEvent) {
 				break;
 			}
-			perror("pcc_server: Failed to accept connection");
+			if (event.data.fd == childEvents) {
+				struct signalfd_siginfo signal;
+				while (read(childEvents, &signal, sizeof(signal)) == sizeof(signal)); // One wait covers them all
+				reapProcesses(0);
+			}
+			else {
+				answerAdmins(adminListener, connectionsPerSecond, bytesPerSecond);
+			}
+		}
+	}
+
+	if (adminPath) {
+		close(adminListener);
+		unlink(adminPath);
+	}
+	close(epoll);
+}
+
+int main(int argc, char* argv[]) {
+	int numberOfWorkers = 0; // Per process in prefork mode
+	int option;
+	while ((option = getopt(argc, argv, "w:P:b:r:l:a:c:t:m:q:S:i:")) != -1) {
+		switch (option) {
+			case 'w':
+				numberOfWorkers = atoi(optarg);
+				break;
+			case 'P':
+				numberOfProcesses = atoi(optarg);
+				break;
+			case 'b':
+				bufferSize = atoi(optarg);
+				break;
+			case 'r':
+				receiveBufferSize = atoi(optarg);
+				break;
+			case 'l':
+				lowWatermark = atoi(optarg);
+				break;
+			case 'a':
+				adminPath = optarg;
+				break;
+			case 'c':
+				maximumConnections = atoi(optarg);
+				break;
+			case 't':
+				readTimeout = atof(optarg);
+				break;
+			case 'm':
+				maximumPayload = strtoull(optarg, NULL, 10);
+				break;
+			case 'q':
+				backlog = atoi(optarg);
+				break;
+			case 'S':
+				snapshotPath = optarg;
+				break;
+			case 'i':
+				snapshotInterval = atof(optarg);
+				break;
+			default:
+				fprintf(stderr, "USAGE: ./pcc_server [-w WORKERS] [-P PROCESSES] [-b BUFFER_SIZE] [-r SO_RCVBUF] [-l SO_RCVLOWAT] [-a ADMIN_SOCKET] [-c MAX_CONNECTIONS] [-t READ_TIMEOUT] [-m MAX_PAYLOAD] [-q BACKLOG] [-S SNAPSHOT_FILE [-i SNAPSHOT_INTERVAL]] <PORT>\n");
+				return 1;
+		}
+	}
+	if (!numberOfWorkers) { // A core each, either way
+		numberOfWorkers = numberOfProcesses ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (optind >= argc || numberOfWorkers < 1 || numberOfProcesses < 0 || bufferSize < 1 || receiveBufferSize < 0 || lowWatermark < 0
+			|| maximumConnections < 0 || readTimeout < 0 || backlog < 1 || snapshotInterval <= 0) {
+		fprintf(stderr, "USAGE: ./pcc_server [-w WORKERS] [-P PROCESSES] [-b BUFFER_SIZE] [-r SO_RCVBUF] [-l SO_RCVLOWAT] [-a ADMIN_SOCKET] [-c MAX_CONNECTIONS] [-t READ_TIMEOUT] [-m MAX_PAYLOAD] [-q BACKLOG] [-S SNAPSHOT_FILE [-i SNAPSHOT_INTERVAL]] <PORT>\n");
+		return 1;
+	}
+
+	if ((shutdownEvent = eventfd(0, EFD_NONBLOCK)) == -1) {
+		perror("pcc_server: Could not create shutdown event");
+		return 1;
+	}
+	if (signal(SIGINT, sigIntHandler) == SIG_ERR) {
+		perror("pcc_server: Could not register signal handler");
+		return 1;
+	}
+	serverPort = (unsigned int) atoi(argv[optind]);
+	checkPortFree();
+
+	numberOfShards = numberOfWorkers * (numberOfProcesses ? numberOfProcesses : 1);
+	shards = (Shard*) allocateShared(sizeof(Shard) * numberOfShards);
+	connectionCounts = (int*) allocateShared(sizeof(int) * (numberOfProcesses ? numberOfProcesses : 1));
+	activeConnections = &connectionCounts[0];
+	if (snapshotPath) {
+		loadSnapshot();
+	}
+
+	if (numberOfProcesses) {
+		workersPerProcess = numberOfWorkers;
+		processes = (pid_t*) calloc(numberOfProcesses, sizeof(pid_t));
+		processStarts = (double*) calloc(numberOfProcesses, sizeof(double));
+		if (!processes || !processStarts) {
+			perror("pcc_server: Could not allocate worker processes");
 			return 1;
 		}
 
-		if (pthread_create(&thread_id, NULL, threadFunction, (void*) &connection)) {
-			perror("pcc_server: Failed to create thread for connection");
+		sigset_t signals; // Worker processes' deaths come through epoll, like everything else
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &signals, NULL);
+		if ((childEvents = signalfd(-1, &signals, SFD_NONBLOCK)) == -1) {
+			perror("pcc_server: Could not watch worker processes");
 			return 1;
 		}
+
+		for (int i = 0; i < numberOfProcesses; i++) {
+			spawnProcess(i);
+		}
+		serveAdmin(); // Until SIGINT
+		reapProcesses(1); // They drain on their own
 	}
+	else {
+		Worker* workers = (Worker*) calloc(numberOfWorkers, sizeof(Worker));
+		if (!workers) {
+			perror("pcc_server: Could not allocate workers");
+			return 1;
+		}
+
+		startWorkers(workers, numberOfWorkers, shards);
+		serveAdmin(); // Until SIGINT
+		joinWorkers(workers, numberOfWorkers);
+	}
+
+	if (snapshotPath) { // Everything's drained, so this one has it all
+		saveSnapshot();
+	}
+
+	Snapshot snapshot;
+	mergeShards(&snapshot);
+	printf("\n");
+	printHistogram(stdout, &snapshot);
+	fflush(stdout);
 
 	return 0;
 }
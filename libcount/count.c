@@ -0,0 +1,291 @@
+#include "count.h"
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define SUB_HISTOGRAMS 4 // Consecutive bytes go to different tables, so increments don't wait on each other
+#define SUB_HISTOGRAM_THRESHOLD 1024 // Below this, clearing the tables costs more than it saves
+#define SUB_HISTOGRAM_CHUNK (1 << 30) // Keeps the 32-bit table counters from wrapping
+
+static void (*histogramKernel)(const void*, size_t, uint64_t*);
+static uint64_t (*byteRangeKernel)(const void*, size_t, unsigned char, unsigned char);
+static void (*xorKernel)(void*, const void*, size_t);
+static uint64_t (*substringKernel)(const void*, size_t, const void*, size_t);
+static const char* kernelName;
+
+/***
+ * Scalar references.
+ */
+
+void countHistogramScalar(const void* buffer, size_t length, uint64_t counts[256]) {
+	const unsigned char* bytes = (const unsigned char*) buffer;
+	for (size_t i = 0; i < length; i++) {
+		counts[bytes[i]]++;
+	}
+}
+
+uint64_t countByteRangeScalar(const void* buffer, size_t length, unsigned char low, unsigned char high) {
+	const unsigned char* bytes = (const unsigned char*) buffer;
+	uint64_t count = 0;
+	for (size_t i = 0; i < length; i++) {
+		count += (unsigned char) (bytes[i] - low) <= (unsigned char) (high - low);
+	}
+
+	return count;
+}
+
+void countXorScalar(void* destination, const void* source, size_t length) {
+	char* to = (char*) destination;
+	const char* from = (const char*) source;
+	for (size_t i = 0; i < length; i++) {
+		to[i] ^= from[i];
+	}
+}
+
+// memchr() to the first byte, memcmp() the rest
+uint64_t countSubstringScalar(const void* buffer, size_t length, const void* pattern, size_t patternLength) {
+	const char* text = (const char*) buffer;
+	const char* needle = (const char*) pattern;
+	const char* end = text + length;
+	const char* match = text;
+	uint64_t count = 0;
+	while (patternLength <= (size_t) (end - match) &&
+			(match = (const char*) memchr(match, needle[0], end - match - patternLength + 1))) {
+		count += !memcmp(match + 1, needle + 1, patternLength - 1);
+		match++;
+	}
+
+	return count;
+}
+
+/***
+ * Portable, but faster than the references.
+ */
+
+/***
+ * Counts all 256 values branch-free into SUB_HISTOGRAMS tables, then adds them up.
+ */
+static void histogramTables(const void* buffer, size_t length, uint64_t counts[256]) {
+	if (length < SUB_HISTOGRAM_THRESHOLD) {
+		countHistogramScalar(buffer, length, counts);
+		return;
+	}
+
+	const unsigned char* bytes = (const unsigned char*) buffer;
+	uint32_t tables[SUB_HISTOGRAMS][256];
+	while (length) {
+		size_t chunk = length > SUB_HISTOGRAM_CHUNK ? SUB_HISTOGRAM_CHUNK : length;
+		size_t i = 0;
+		uint64_t word;
+		memset(tables, 0, sizeof(tables));
+
+		for (; i + 8 <= chunk; i += 8) {
+			memcpy(&word, bytes + i, sizeof(word));
+			tables[0][word & 0xff]++;
+			tables[1][(word >> 8) & 0xff]++;
+			tables[2][(word >> 16) & 0xff]++;
+			tables[3][(word >> 24) & 0xff]++;
+			tables[0][(word >> 32) & 0xff]++;
+			tables[1][(word >> 40) & 0xff]++;
+			tables[2][(word >> 48) & 0xff]++;
+			tables[3][word >> 56]++;
+		}
+		for (; i < chunk; i++) { // Leftovers
+			tables[0][bytes[i]]++;
+		}
+
+		for (int c = 0; c < 256; c++) {
+			counts[c] += (uint64_t) tables[0][c] + tables[1][c] + tables[2][c] + tables[3][c];
+		}
+
+		bytes += chunk;
+		length -= chunk;
+	}
+}
+
+static void xorWords(void* destination, const void* source, size_t length) {
+	char* to = (char*) destination;
+	const char* from = (const char*) source;
+	uint64_t a, b;
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		memcpy(&a, to + i, 8);
+		memcpy(&b, from + i, 8);
+		a ^= b;
+		memcpy(to + i, &a, 8);
+	}
+
+	countXorScalar(to + i, from + i, length - i);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/***
+ * b is in [low, high] exactly when b - low, unsigned, is at most high - low - and
+ * unsigned "at most" is min(x, y) == x. Masks are subtracted into byte counters,
+ * which are widened with SAD before they can wrap.
+ */
+__attribute__((target("sse2")))
+static uint64_t byteRangeSse2(const void* buffer, size_t length, unsigned char low, unsigned char high) {
+	const unsigned char* bytes = (const unsigned char*) buffer;
+	const __m128i lows = _mm_set1_epi8((char) low), width = _mm_set1_epi8((char) (high - low));
+	__m128i total = _mm_setzero_si128();
+	size_t i = 0;
+	while (i + 16 <= length) {
+		__m128i counters = _mm_setzero_si128();
+		for (int round = 0; round < 255 && i + 16 <= length; round++, i += 16) {
+			__m128i offsets = _mm_sub_epi8(_mm_loadu_si128((const __m128i*) (bytes + i)), lows);
+			counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(_mm_min_epu8(offsets, width), offsets));
+		}
+		total = _mm_add_epi64(total, _mm_sad_epu8(counters, _mm_setzero_si128()));
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i*) lanes, total);
+	return lanes[0] + lanes[1] + countByteRangeScalar(bytes + i, length - i, low, high);
+}
+
+__attribute__((target("avx2")))
+static uint64_t byteRangeAvx2(const void* buffer, size_t length, unsigned char low, unsigned char high) {
+	const unsigned char* bytes = (const unsigned char*) buffer;
+	const __m256i lows = _mm256_set1_epi8((char) low), width = _mm256_set1_epi8((char) (high - low));
+	__m256i total = _mm256_setzero_si256();
+	size_t i = 0;
+	while (i + 32 <= length) {
+		__m256i counters = _mm256_setzero_si256();
+		for (int round = 0; round < 255 && i + 32 <= length; round++, i += 32) {
+			__m256i offsets = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*) (bytes + i)), lows);
+			counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(_mm256_min_epu8(offsets, width), offsets));
+		}
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(counters, _mm256_setzero_si256()));
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i*) lanes, total);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + countByteRangeScalar(bytes + i, length - i, low, high);
+}
+
+__attribute__((target("sse2")))
+static void xorSse2(void* destination, const void* source, size_t length) {
+	char* to = (char*) destination;
+	const char* from = (const char*) source;
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*) (to + i));
+		_mm_storeu_si128((__m128i*) (to + i), _mm_xor_si128(a, _mm_loadu_si128((const __m128i*) (from + i))));
+	}
+
+	countXorScalar(to + i, from + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void xorAvx2(void* destination, const void* source, size_t length) {
+	char* to = (char*) destination;
+	const char* from = (const char*) source;
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*) (to + i));
+		_mm256_storeu_si256((__m256i*) (to + i), _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*) (from + i))));
+	}
+
+	countXorScalar(to + i, from + i, length - i);
+}
+
+/***
+ * Compares a vector of positions against the pattern's first byte, and the vector
+ * patternLength - 1 further along against its last byte. Only positions passing both
+ * get a memcmp() of the middle, which for anything but the most repetitive patterns
+ * is next to none of them.
+ */
+__attribute__((target("sse2")))
+static uint64_t substringSse2(const void* buffer, size_t length, const void* pattern, size_t patternLength) {
+	const char* text = (const char*) buffer;
+	const char* needle = (const char*) pattern;
+	const __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[patternLength - 1]);
+	uint64_t count = 0;
+	size_t i = 0;
+	for (; i + patternLength - 1 + 16 <= length; i += 16) {
+		__m128i starts = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (text + i)), first);
+		__m128i ends = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (text + i + patternLength - 1)), last);
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(starts, ends));
+		while (mask) {
+			if (patternLength <= 2 || !memcmp(text + i + __builtin_ctz(mask) + 1, needle + 1, patternLength - 2)) {
+				count++;
+			}
+			mask &= mask - 1;
+		}
+	}
+
+	return count + countSubstringScalar(text + i, length - i, pattern, patternLength);
+}
+
+__attribute__((target("avx2")))
+static uint64_t substringAvx2(const void* buffer, size_t length, const void* pattern, size_t patternLength) {
+	const char* text = (const char*) buffer;
+	const char* needle = (const char*) pattern;
+	const __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[patternLength - 1]);
+	uint64_t count = 0;
+	size_t i = 0;
+	for (; i + patternLength - 1 + 32 <= length; i += 32) {
+		__m256i starts = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (text + i)), first);
+		__m256i ends = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (text + i + patternLength - 1)), last);
+		unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_and_si256(starts, ends));
+		while (mask) {
+			if (patternLength <= 2 || !memcmp(text + i + __builtin_ctz(mask) + 1, needle + 1, patternLength - 2)) {
+				count++;
+			}
+			mask &= mask - 1;
+		}
+	}
+
+	return count + countSubstringScalar(text + i, length - i, pattern, patternLength);
+}
+#endif
+
+/***
+ * Picks the widest kernels the CPU supports, before main() - so the dispatched
+ * functions are safe to call from any thread without a check.
+ */
+__attribute__((constructor))
+static void countInit() {
+	histogramKernel = histogramTables; // Sub-tables beat anything vectorized short of AVX-512
+	byteRangeKernel = countByteRangeScalar;
+	xorKernel = xorWords;
+	substringKernel = countSubstringScalar;
+	kernelName = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		byteRangeKernel = byteRangeAvx2;
+		xorKernel = xorAvx2;
+		substringKernel = substringAvx2;
+		kernelName = "avx2";
+	}
+	else if (__builtin_cpu_supports("sse2")) {
+		byteRangeKernel = byteRangeSse2;
+		xorKernel = xorSse2;
+		substringKernel = substringSse2;
+		kernelName = "sse2";
+	}
+#endif
+}
+
+void countHistogram(const void* buffer, size_t length, uint64_t counts[256]) {
+	histogramKernel(buffer, length, counts);
+}
+
+uint64_t countByteRange(const void* buffer, size_t length, unsigned char low, unsigned char high) {
+	return byteRangeKernel(buffer, length, low, high);
+}
+
+void countXor(void* destination, const void* source, size_t length) {
+	xorKernel(destination, source, length);
+}
+
+uint64_t countSubstring(const void* buffer, size_t length, const void* pattern, size_t patternLength) {
+	return substringKernel(buffer, length, pattern, patternLength);
+}
+
+const char* countKernelName() {
+	return kernelName;
+}
@@ -0,0 +1,43 @@
+#ifndef _COUNT_H
+#define _COUNT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/***
+ * The byte scanning kernels the tools share. Each has a plain scalar version - the
+ * reference the others are checked against - and a dispatched one that runs the
+ * widest version the CPU supports, picked once at startup.
+ */
+
+/***
+ * Adds the number of times each byte value appears in buffer to counts.
+ */
+void countHistogram(const void* buffer, size_t length, uint64_t counts[256]);
+void countHistogramScalar(const void* buffer, size_t length, uint64_t counts[256]);
+
+/***
+ * Number of bytes in buffer between low and high, inclusive.
+ */
+uint64_t countByteRange(const void* buffer, size_t length, unsigned char low, unsigned char high);
+uint64_t countByteRangeScalar(const void* buffer, size_t length, unsigned char low, unsigned char high);
+
+/***
+ * destination ^= source, length bytes.
+ */
+void countXor(void* destination, const void* source, size_t length);
+void countXorScalar(void* destination, const void* source, size_t length);
+
+/***
+ * Overlapping matches of pattern in buffer - every position it starts at, as long as
+ * it ends inside the buffer. The pattern must not be empty.
+ */
+uint64_t countSubstring(const void* buffer, size_t length, const void* pattern, size_t patternLength);
+uint64_t countSubstringScalar(const void* buffer, size_t length, const void* pattern, size_t patternLength);
+
+/***
+ * Name of the instruction set the dispatched kernels ended up with.
+ */
+const char* countKernelName();
+
+#endif
@@ -0,0 +1,215 @@
+#include "count.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_BUFFER_SIZE (64 * 1024 * 1024)
+#define DEFAULT_ITERATIONS 10
+#define CHECK_BUFFER_SIZE (1024 * 1024 + 37) // -c's default - odd, so the whole buffer ends in leftovers too
+#define SEAM_LENGTHS 100 // Short lengths are all leftovers - every one of them is checked
+#define SUBSTRING_CHECK_SIZE (4 * 1024 * 1024) // Past this it's more of the same loop, for each of a dozen or so patterns
+#define SLACK 33 // Bytes past the length, for the largest offset and xor's source being one byte on
+
+const char* pattern = "ab"; // Short, so the xorshift data has plenty of matches
+const size_t offsets[] = { 0, 1, 3, 17, 31 }; // Starts checked - every misalignment a 32 byte load can have, near enough
+const size_t patternLengths[] = { 1, 2, 3, 16, 31, 32, 33 }; // Either side of the vector widths, where the kernels change tack
+
+double seconds() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+void report(const char* kernel, size_t length, int iterations, double elapsed) {
+	printf("%-24s %8.1f MB/s per core\n", kernel, (double) length * iterations / elapsed / 1048576);
+}
+
+int fail(const char* kernel, size_t length) {
+	fprintf(stderr, "count_bench: %s disagrees with scalar one on %zu bytes\n", kernel, length);
+	return 1;
+}
+
+int substringDisagrees(const unsigned char* data, size_t length, const void* needle, size_t needleLength) {
+	return countSubstring(data, length, needle, needleLength) != countSubstringScalar(data, length, needle, needleLength);
+}
+
+/***
+ * The pattern at cut and, when it's long enough to have a middle, near misses of it -
+ * a byte off just after the first, in the middle and just before the last, which only
+ * a kernel that skipped comparing it would count.
+ */
+int checkCut(const unsigned char* data, size_t length, const unsigned char* cut, size_t patternLength) {
+	unsigned char needle[64];
+	memcpy(needle, cut, patternLength);
+	if (substringDisagrees(data, length, needle, patternLength)) {
+		return 1;
+	}
+
+	size_t misses[] = { 1, patternLength / 2, patternLength - 2 };
+	for (size_t i = 0; patternLength > 2 && i < sizeof(misses) / sizeof(misses[0]); i++) {
+		needle[misses[i]] ^= 1;
+		if (substringDisagrees(data, length, needle, patternLength)) {
+			return 1;
+		}
+		needle[misses[i]] ^= 1;
+	}
+
+	return 0;
+}
+
+/***
+ * Patterns of every length in patternLengths - "abab...", which the data's full of the
+ * beginnings of, and ones cut out of the data itself, so there's at least one match,
+ * in the middle and right at the end.
+ */
+int checkSubstrings(const unsigned char* data, size_t length) {
+	char alternating[64];
+	for (size_t i = 0; i < sizeof(alternating); i++) {
+		alternating[i] = "ab"[i % 2];
+	}
+
+	for (size_t i = 0; i < sizeof(patternLengths) / sizeof(patternLengths[0]); i++) {
+		size_t patternLength = patternLengths[i];
+		if (substringDisagrees(data, length, alternating, patternLength)
+				|| (patternLength <= length && (checkCut(data, length, data + (length - patternLength) / 2, patternLength)
+						|| checkCut(data, length, data + length - patternLength, patternLength)))) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/***
+ * Every dispatched kernel against its reference, on length bytes - from the buffer's
+ * start and from each of the offsets, so unaligned loads and leftovers get their turn.
+ */
+int check(const unsigned char* buffer, unsigned char* scratch, unsigned char* reference, size_t length) {
+	for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+		size_t offset = offsets[i];
+		const unsigned char* data = buffer + offset;
+		uint64_t counts[256] = { 0 }, expected[256] = { 0 };
+		countHistogram(data, length, counts);
+		countHistogramScalar(data, length, expected);
+		if (memcmp(counts, expected, sizeof(counts))) {
+			return fail("histogram", length);
+		}
+
+		if (countByteRange(data, length, 32, 126) != countByteRangeScalar(data, length, 32, 126)
+				|| countByteRange(data, length, 200, 10) != countByteRangeScalar(data, length, 200, 10)) {
+			return fail("byte range", length);
+		}
+
+		memcpy(scratch, buffer, length + offset);
+		memcpy(reference, buffer, length + offset);
+		countXor(scratch + offset, data + 1, length);
+		countXorScalar(reference + offset, data + 1, length);
+		if (memcmp(scratch, reference, length + offset)) {
+			return fail("xor", length);
+		}
+
+		if (checkSubstrings(data, length < SUBSTRING_CHECK_SIZE ? length : SUBSTRING_CHECK_SIZE)) {
+			return fail("substring", length);
+		}
+	}
+
+	return 0;
+}
+
+/***
+ * With -c, only checks the kernels against the scalar references (make check) -
+ * nothing's timed, and the exit status says whether they all agreed.
+ */
+int main(int argc, char* argv[]) {
+	int checkOnly = argc > 1 && !strcmp(argv[1], "-c");
+	argv += checkOnly;
+	argc -= checkOnly;
+	size_t length = argc > 1 ? (size_t) atol(argv[1]) : checkOnly ? CHECK_BUFFER_SIZE : DEFAULT_BUFFER_SIZE;
+	int iterations = argc > 2 ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+	unsigned char* buffer = (unsigned char*) malloc(length + SLACK);
+	unsigned char* scratch = (unsigned char*) malloc(length + SLACK);
+	unsigned char* reference = (unsigned char*) malloc(length + SLACK);
+	if (!buffer || !scratch || !reference || !length || iterations < 1) {
+		fprintf(stderr, "USAGE: ./count_bench [-c] [BUFFER_SIZE] [ITERATIONS]\n");
+		return 1;
+	}
+
+	uint64_t state = 88172645463325252ULL; // xorshift64, same data every run
+	for (size_t i = 0; i < length + SLACK; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		buffer[i] = (unsigned char) state % 4 ? (unsigned char) state : 'a' + (unsigned char) (state >> 8) % 2;
+	}
+
+	for (size_t seam = 0; seam < SEAM_LENGTHS && seam < length; seam++) {
+		if (check(buffer, scratch, reference, seam)) {
+			return 1;
+		}
+	}
+	if (check(buffer, scratch, reference, length)) {
+		return 1;
+	}
+	printf("Kernels: %s, all agree with the scalar references\n", countKernelName());
+	if (checkOnly) {
+		free(buffer);
+		free(scratch);
+		free(reference);
+		return 0;
+	}
+
+	uint64_t counts[256];
+	double start = seconds();
+	for (int i = 0; i < iterations; i++) {
+		memset(counts, 0, sizeof(counts));
+		countHistogramScalar(buffer, length, counts);
+	}
+	report("histogram (scalar)", length, iterations, seconds() - start);
+	start = seconds();
+	for (int i = 0; i < iterations; i++) {
+		memset(counts, 0, sizeof(counts));
+		countHistogram(buffer, length, counts);
+	}
+	report("histogram", length, iterations, seconds() - start);
+
+	volatile uint64_t sink; // So the loops aren't optimized away
+	start = seconds();
+	for (int i = 0; i < iterations; i++) {
+		sink = countByteRangeScalar(buffer, length, 32, 126);
+	}
+	report("byte range (scalar)", length, iterations, seconds() - start);
+	start = seconds();
+	for (int i = 0; i < iterations; i++) {
+		sink = countByteRange(buffer, length, 32, 126);
+	}
+	report("byte range", length, iterations, seconds() - start);
+
+	start = seconds();
+	for (int i = 0; i < iterations; i++) {
+		countXorScalar(scratch, buffer, length);
+	}
+	report("xor (scalar)", length, iterations, seconds() - start);
+	start = seconds();
+	for (int i = 0; i < iterations; i++) {
+		countXor(scratch, buffer, length);
+	}
+	report("xor", length, iterations, seconds() - start);
+
+	start = seconds();
+	for (int i = 0; i < iterations; i++) {
+		sink = countSubstringScalar(buffer, length, pattern, strlen(pattern));
+	}
+	report("substring (scalar)", length, iterations, seconds() - start);
+	start = seconds();
+	for (int i = 0; i < iterations; i++) {
+		sink = countSubstring(buffer, length, pattern, strlen(pattern));
+	}
+	report("substring", length, iterations, seconds() - start);
+	(void) sink;
+
+	free(buffer);
+	free(scratch);
+	free(reference);
+	return 0;
+}
@@ -0,0 +1,523 @@
+#include "decode.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define DECODE_CHUNK_SIZE (1024 * 1024) // Decoded, per chunk when streaming
+#define DECODE_INPUT_SIZE (256 * 1024) // Compressed, read at a time
+#define DECODE_STREAM_CHUNKS 3 // One being read, one being decoded, one to spare
+#define DECODE_FRAME_LIMIT (32 * 1024 * 1024) // Bigger frames than this are streamed, not held whole
+#define GZIP_WINDOW_BITS (15 + 16) // Maximum window, gzip header only
+
+typedef struct decode_chunk_t {
+	char* data;
+	size_t length;
+	size_t capacity;
+	int ready; // Decoded, and not read through yet
+} DecodeChunk;
+
+/***
+ * Chunks are decoded in sequence - a chunk of the stream, or a whole frame - into a
+ * ring, chunk n going to chunks[n % numberOfChunks]. Nothing's decoded more than the
+ * ring's length ahead of the reader.
+ */
+struct decoder_t {
+	int fileDescriptor; // -1 while detached
+	int format;
+	int direct; // No threads or chunks - decodeRead decodes straight into the reader's buffer
+	pthread_t* threads;
+	int numberOfThreads;
+	DecodeChunk* chunks;
+	int numberOfChunks;
+	long long nextClaim; // Next sequence for a thread to decode
+	long long nextRead; // The reader's
+	size_t readOffset; // Into nextRead's chunk
+	long long numberOfSequences; // -1 until the stream's end is found
+	int failed;
+	int stopping;
+	pthread_mutex_t mutex;
+	pthread_cond_t produced;
+	pthread_cond_t consumed;
+
+	unsigned char* input; // Streaming - only the decoding thread (the reader's, if direct) touches these
+	size_t inputLength;
+	off_t inputOffset; // Of the next compressed byte to read
+	int inputEnded;
+	z_stream gzip;
+	int inMember; // Of a gzip stream, so EOF there means it's truncated
+#ifdef HAVE_ZSTD
+	ZSTD_DStream* zstd;
+	ZSTD_inBuffer zstdInput;
+	size_t zstdPending; // What ZSTD_decompressStream last asked for - 0 between frames
+
+	const char* mapped; // Parallel frames - the whole file, and where each frame starts
+	size_t mappedLength;
+	size_t* frameOffsets; // numberOfSequences + 1 of them
+#endif
+};
+
+int decodeFormat(int fileDescriptor) {
+	unsigned char magic[4];
+	ssize_t readBytes = pread(fileDescriptor, magic, sizeof(magic), 0);
+	if (readBytes >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+		return DECODE_GZIP;
+	}
+	if (readBytes == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+		return DECODE_ZSTD;
+	}
+
+	return DECODE_NONE;
+}
+
+const char* decodeFormatName(int format) {
+	return format == DECODE_GZIP ? "gzip" : format == DECODE_ZSTD ? "zstd" : "none";
+}
+
+/***
+ * Reads the next of the compressed input, once the last's been used - from where the
+ * decoder got to, so a descriptor reattached anywhere in the file will do. Pipes are
+ * just read. Returns 0, or -1 on error.
+ */
+static int refill(Decoder* decoder) {
+	ssize_t readBytes;
+	do {
+		readBytes = pread(decoder->fileDescriptor, decoder->input, DECODE_INPUT_SIZE, decoder->inputOffset);
+		if (readBytes < 0 && errno == ESPIPE) {
+			readBytes = read(decoder->fileDescriptor, decoder->input, DECODE_INPUT_SIZE);
+		}
+	} while (readBytes < 0 && errno == EINTR);
+	if (readBytes < 0) {
+		return -1;
+	}
+
+	decoder->inputOffset += readBytes;
+	decoder->inputLength = readBytes;
+	decoder->inputEnded = !readBytes;
+	return 0;
+}
+
+/***
+ * Fills size bytes of output - a chunk, or the reader's buffer - from a gzip stream,
+ * setting length to how many it got. Returns 1 if they're all there, 0 if the stream
+ * ended in them, -1 on error.
+ */
+static int gzipFill(Decoder* decoder, char* output, size_t size, size_t* length) {
+	z_stream* stream = &decoder->gzip;
+	stream->next_out = (unsigned char*) output;
+	stream->avail_out = size;
+
+	while (stream->avail_out) {
+		if (!stream->avail_in && !decoder->inputEnded) {
+			if (refill(decoder) < 0) {
+				return -1;
+			}
+			stream->next_in = decoder->input;
+			stream->avail_in = decoder->inputLength;
+		}
+		if (!stream->avail_in) { // EOF - fine between members, not inside one
+			*length = size - stream->avail_out;
+			return decoder->inMember ? -1 : 0;
+		}
+
+		decoder->inMember = 1;
+		int result = inflate(stream, Z_NO_FLUSH);
+		if (result == Z_STREAM_END) { // Another member may follow
+			decoder->inMember = 0;
+			if (inflateReset(stream) != Z_OK) {
+				return -1;
+			}
+		}
+		else if (result != Z_OK) {
+			return -1;
+		}
+	}
+
+	*length = size;
+	return 1;
+}
+
+#ifdef HAVE_ZSTD
+static int zstdFill(Decoder* decoder, char* data, size_t size, size_t* length) {
+	ZSTD_outBuffer output = { data, size, 0 };
+
+	while (output.pos < output.size) {
+		if (decoder->zstdInput.pos == decoder->zstdInput.size && !decoder->inputEnded) {
+			if (refill(decoder) < 0) {
+				return -1;
+			}
+			decoder->zstdInput.src = decoder->input;
+			decoder->zstdInput.size = decoder->inputLength;
+			decoder->zstdInput.pos = 0;
+		}
+
+		size_t before = output.pos, consumed = decoder->zstdInput.pos;
+		size_t result = ZSTD_decompressStream(decoder->zstd, &output, &decoder->zstdInput);
+		if (ZSTD_isError(result)) {
+			return -1;
+		}
+		if (output.pos != before || decoder->zstdInput.pos != consumed) { // Idle calls only hint at the next frame's header
+			decoder->zstdPending = result;
+		}
+		else if (decoder->inputEnded) { // Flushed all it had
+			*length = output.pos;
+			return decoder->zstdPending ? -1 : 0;
+		}
+	}
+
+	*length = output.pos;
+	return 1;
+}
+
+/***
+ * Finds every frame in the mapped file, if the file's worth decoding in parallel -
+ * more than one frame, and all of them of a known, holdable size. Returns how many,
+ * or -1 to stream it instead.
+ */
+static long long findFrames(Decoder* decoder) {
+	size_t capacity = 64;
+	long long count = 0;
+	if (!(decoder->frameOffsets = (size_t*) malloc(capacity * sizeof(size_t)))) {
+		return -1;
+	}
+
+	size_t offset = 0;
+	while (offset < decoder->mappedLength) {
+		size_t frameLength = ZSTD_findFrameCompressedSize(decoder->mapped + offset, decoder->mappedLength - offset);
+		unsigned long long contentSize = ZSTD_getFrameContentSize(decoder->mapped + offset, decoder->mappedLength - offset);
+		if (ZSTD_isError(frameLength) || contentSize > DECODE_FRAME_LIMIT) { // Unknown and error sizes are huge too
+			return -1;
+		}
+		if ((size_t) count + 2 > capacity) { // Room for the end, too
+			size_t* grown = (size_t*) realloc(decoder->frameOffsets, (capacity *= 2) * sizeof(size_t));
+			if (!grown) {
+				return -1;
+			}
+			decoder->frameOffsets = grown;
+		}
+		decoder->frameOffsets[count++] = offset;
+		offset += frameLength;
+	}
+	decoder->frameOffsets[count] = offset;
+
+	return count > 1 ? count : -1;
+}
+#endif
+
+/***
+ * Waits for the next sequence to have room in the ring, and claims it. Returns -1 if
+ * there's nothing left to claim.
+ */
+static long long claimSequence(Decoder* decoder) {
+	long long sequence = -1;
+	pthread_mutex_lock(&decoder->mutex);
+	while (!decoder->stopping && !decoder->failed && (decoder->numberOfSequences < 0 || decoder->nextClaim < decoder->numberOfSequences)
+			&& decoder->nextClaim >= decoder->nextRead + decoder->numberOfChunks) {
+		pthread_cond_wait(&decoder->consumed, &decoder->mutex);
+	}
+	if (!decoder->stopping && !decoder->failed && (decoder->numberOfSequences < 0 || decoder->nextClaim < decoder->numberOfSequences)) {
+		sequence = decoder->nextClaim++;
+	}
+	pthread_mutex_unlock(&decoder->mutex);
+
+	return sequence;
+}
+
+/***
+ * Hands a decoded chunk to the reader - more is what the fill returned.
+ */
+static void publishChunk(Decoder* decoder, long long sequence, int more) {
+	pthread_mutex_lock(&decoder->mutex);
+	decoder->chunks[sequence % decoder->numberOfChunks].ready = 1;
+	if (more < 0) {
+		decoder->failed = 1;
+	}
+	else if (!more) {
+		decoder->numberOfSequences = sequence + 1;
+	}
+	pthread_cond_broadcast(&decoder->produced);
+	pthread_mutex_unlock(&decoder->mutex);
+}
+
+static int fill(Decoder* decoder, char* output, size_t size, size_t* length) {
+#ifdef HAVE_ZSTD
+	return decoder->format == DECODE_GZIP ? gzipFill(decoder, output, size, length) : zstdFill(decoder, output, size, length);
+#else
+	return gzipFill(decoder, output, size, length);
+#endif
+}
+
+static void* decodeStream(void* parameter) {
+	Decoder* decoder = (Decoder*) parameter;
+	long long sequence;
+	while ((sequence = claimSequence(decoder)) >= 0) {
+		DecodeChunk* chunk = &decoder->chunks[sequence % decoder->numberOfChunks];
+		publishChunk(decoder, sequence, fill(decoder, chunk->data, DECODE_CHUNK_SIZE, &chunk->length));
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_ZSTD
+static void* decodeFrames(void* parameter) {
+	Decoder* decoder = (Decoder*) parameter;
+	ZSTD_DCtx* context = ZSTD_createDCtx();
+	long long sequence;
+	while ((sequence = claimSequence(decoder)) >= 0) {
+		DecodeChunk* chunk = &decoder->chunks[sequence % decoder->numberOfChunks];
+		const char* frame = decoder->mapped + decoder->frameOffsets[sequence];
+		size_t frameLength = decoder->frameOffsets[sequence + 1] - decoder->frameOffsets[sequence];
+		size_t contentSize = (size_t) ZSTD_getFrameContentSize(frame, frameLength); // Checked by findFrames
+		int more = 1;
+
+		if (contentSize > chunk->capacity) {
+			free(chunk->data);
+			chunk->capacity = (chunk->data = (char*) malloc(contentSize)) ? contentSize : 0;
+		}
+		size_t result = !context || contentSize > chunk->capacity ? (size_t) -1
+				: ZSTD_decompressDCtx(context, chunk->data, contentSize, frame, frameLength);
+		if (ZSTD_isError(result) || result != contentSize) {
+			more = -1;
+		}
+		chunk->length = contentSize;
+		publishChunk(decoder, sequence, more); // The end's known already
+	}
+
+	ZSTD_freeDCtx(context);
+	return NULL;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/***
+ * Maps a zstd file, to decode its frames in parallel if it's worth it (see findFrames).
+ * Returns how many threads to run, 0 to stream it instead.
+ */
+static int prepareFrames(Decoder* decoder, int numberOfThreads) {
+	struct stat fileStat;
+	if (fstat(decoder->fileDescriptor, &fileStat) || !S_ISREG(fileStat.st_mode) || !fileStat.st_size) {
+		return 0;
+	}
+
+	decoder->mappedLength = fileStat.st_size;
+	decoder->mapped = (const char*) mmap(NULL, decoder->mappedLength, PROT_READ, MAP_PRIVATE, decoder->fileDescriptor, 0);
+	if (decoder->mapped == MAP_FAILED) {
+		decoder->mapped = NULL;
+		return 0;
+	}
+	if ((decoder->numberOfSequences = findFrames(decoder)) < 0) {
+		return 0;
+	}
+
+	madvise((void*) decoder->mapped, decoder->mappedLength, MADV_SEQUENTIAL);
+	decoder->numberOfChunks = numberOfThreads + 2; // A frame each, and two done ahead
+	return numberOfThreads < decoder->numberOfSequences ? numberOfThreads : (int) decoder->numberOfSequences;
+}
+#endif
+
+/***
+ * The chunks, and the streaming state. Returns 1 - one thread streams it, if any - or
+ * 0 on error.
+ */
+static int decodePrepare(Decoder* decoder) {
+	if (decoder->format == DECODE_GZIP) {
+		if (inflateInit2(&decoder->gzip, GZIP_WINDOW_BITS) != Z_OK) {
+			errno = ENOMEM;
+			return 0;
+		}
+	}
+#ifdef HAVE_ZSTD
+	else if (!(decoder->zstd = ZSTD_createDStream()) || ZSTD_isError(ZSTD_initDStream(decoder->zstd))) {
+		errno = ENOMEM;
+		return 0;
+	}
+#endif
+
+	decoder->numberOfChunks = DECODE_STREAM_CHUNKS;
+	return (decoder->input = (unsigned char*) malloc(DECODE_INPUT_SIZE)) ? 1 : 0;
+}
+
+Decoder* decodeStart(int fileDescriptor, int format, int numberOfThreads) {
+#ifndef HAVE_ZSTD
+	if (format == DECODE_ZSTD) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+#endif
+	if (format != DECODE_GZIP && format != DECODE_ZSTD) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	Decoder* decoder = (Decoder*) calloc(1, sizeof(Decoder));
+	if (!decoder) {
+		return NULL;
+	}
+	decoder->fileDescriptor = fileDescriptor;
+	decoder->format = format;
+	decoder->direct = numberOfThreads < 1;
+	decoder->numberOfSequences = -1;
+	pthread_mutex_init(&decoder->mutex, NULL);
+	pthread_cond_init(&decoder->produced, NULL);
+	pthread_cond_init(&decoder->consumed, NULL);
+	posix_fadvise(fileDescriptor, 0, 0, POSIX_FADV_SEQUENTIAL); // Just a hint
+
+	int threads = 0;
+#ifdef HAVE_ZSTD
+	if (format == DECODE_ZSTD && numberOfThreads > 1) { // A direct decoder's got 0
+		threads = prepareFrames(decoder, numberOfThreads);
+	}
+#endif
+	if (!threads) {
+		threads = decodePrepare(decoder);
+	}
+	if (decoder->direct) { // Streamed, on nobody's thread but the reader's
+		if (!threads) {
+			decodeFinish(decoder);
+			errno = ENOMEM;
+			return NULL;
+		}
+		return decoder;
+	}
+	decoder->chunks = threads ? (DecodeChunk*) calloc(decoder->numberOfChunks, sizeof(DecodeChunk)) : NULL;
+	decoder->threads = decoder->chunks ? (pthread_t*) malloc(threads * sizeof(pthread_t)) : NULL;
+	if (!decoder->threads) {
+		decodeFinish(decoder);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (decoder->input) { // Streaming - the chunks are all the same size
+		for (int i = 0; i < decoder->numberOfChunks; i++) {
+			if (!(decoder->chunks[i].data = (char*) malloc(DECODE_CHUNK_SIZE))) {
+				decodeFinish(decoder);
+				errno = ENOMEM;
+				return NULL;
+			}
+			decoder->chunks[i].capacity = DECODE_CHUNK_SIZE;
+		}
+	}
+
+	for (int i = 0; i < threads; i++) {
+#ifdef HAVE_ZSTD
+		void* (*decode)(void*) = decoder->input ? decodeStream : decodeFrames;
+#else
+		void* (*decode)(void*) = decodeStream;
+#endif
+		if (pthread_create(&decoder->threads[i], NULL, decode, decoder)) {
+			decodeFinish(decoder);
+			errno = EAGAIN;
+			return NULL;
+		}
+		decoder->numberOfThreads++;
+	}
+
+	return decoder;
+}
+
+ssize_t decodeRead(Decoder* decoder, void* buffer, size_t length) {
+	if (decoder->direct) {
+		size_t filled;
+		if (!decoder->input && !(decoder->input = (unsigned char*) malloc(DECODE_INPUT_SIZE))) { // Let go of while detached
+			return -1;
+		}
+		return fill(decoder, (char*) buffer, length, &filled) < 0 ? -1 : (ssize_t) filled;
+	}
+
+	size_t copied = 0;
+	pthread_mutex_lock(&decoder->mutex);
+	while (copied < length) {
+		DecodeChunk* chunk = &decoder->chunks[decoder->nextRead % decoder->numberOfChunks];
+		while (!chunk->ready && !decoder->failed
+				&& (decoder->numberOfSequences < 0 || decoder->nextRead < decoder->numberOfSequences)) {
+			pthread_cond_wait(&decoder->produced, &decoder->mutex);
+		}
+		if (!chunk->ready) { // Failed, or all read
+			break;
+		}
+
+		// The chunk's ours until nextRead moves past it, copy outside the lock
+		size_t take = chunk->length - decoder->readOffset < length - copied ? chunk->length - decoder->readOffset : length - copied;
+		pthread_mutex_unlock(&decoder->mutex);
+		memcpy((char*) buffer + copied, chunk->data + decoder->readOffset, take);
+		pthread_mutex_lock(&decoder->mutex);
+
+		copied += take;
+		decoder->readOffset += take;
+		if (decoder->readOffset == chunk->length) { // Read through, it's free for the next
+			chunk->ready = 0;
+			decoder->readOffset = 0;
+			decoder->nextRead++;
+			pthread_cond_broadcast(&decoder->consumed);
+		}
+	}
+	int failed = decoder->failed && copied < length;
+	pthread_mutex_unlock(&decoder->mutex);
+
+	return failed ? -1 : (ssize_t) copied;
+}
+
+void decodeFinish(Decoder* decoder) {
+	pthread_mutex_lock(&decoder->mutex);
+	decoder->stopping = 1;
+	pthread_cond_broadcast(&decoder->consumed);
+	pthread_mutex_unlock(&decoder->mutex);
+	for (int i = 0; i < decoder->numberOfThreads; i++) {
+		pthread_join(decoder->threads[i], NULL);
+	}
+
+	if (decoder->format == DECODE_GZIP) {
+		inflateEnd(&decoder->gzip);
+	}
+#ifdef HAVE_ZSTD
+	ZSTD_freeDStream(decoder->zstd);
+	if (decoder->mapped) {
+		munmap((void*) decoder->mapped, decoder->mappedLength);
+	}
+	free(decoder->frameOffsets);
+#endif
+	for (int i = 0; decoder->chunks && i < decoder->numberOfChunks; i++) {
+		free(decoder->chunks[i].data);
+	}
+	free(decoder->chunks);
+	free(decoder->threads);
+	free(decoder->input);
+	pthread_cond_destroy(&decoder->consumed);
+	pthread_cond_destroy(&decoder->produced);
+	pthread_mutex_destroy(&decoder->mutex);
+	if (decoder->fileDescriptor >= 0) {
+		close(decoder->fileDescriptor);
+	}
+	free(decoder);
+}
+
+int decodeDetach(Decoder* decoder) {
+	// What was read but not decoded yet is read again once it's attached, so the input can go
+	if (decoder->format == DECODE_GZIP) {
+		decoder->inputOffset -= decoder->gzip.avail_in;
+		decoder->gzip.avail_in = 0;
+	}
+#ifdef HAVE_ZSTD
+	else {
+		decoder->inputOffset -= decoder->zstdInput.size - decoder->zstdInput.pos;
+		decoder->zstdInput.size = decoder->zstdInput.pos = 0;
+	}
+#endif
+	free(decoder->input);
+	decoder->input = NULL;
+
+	int result = close(decoder->fileDescriptor);
+	decoder->fileDescriptor = -1;
+	return result;
+}
+
+void decodeAttach(Decoder* decoder, int fileDescriptor) {
+	decoder->fileDescriptor = fileDescriptor;
+}
@@ -0,0 +1,64 @@
+#ifndef _DECODE_H
+#define _DECODE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/***
+ * Compressed inputs, decoded on threads of their own a chunk ahead of whoever's reading
+ * them - so counting and XOR-ing go on while the next chunk's being inflated, and
+ * nothing's ever decompressed to disk. gzip streams (concatenated members too) are
+ * decoded by a single thread. zstd files made of several frames (pzstd, or anything
+ * compressed in independent pieces) have their frames decoded in parallel; a single
+ * frame is streamed like gzip. zstd is only there if the library was built with
+ * HAVE_ZSTD (see decode.mk).
+ */
+
+#define DECODE_NONE 0 // Not compressed, or not in a format we know
+#define DECODE_GZIP 1
+#define DECODE_ZSTD 2
+
+typedef struct decoder_t Decoder;
+
+/***
+ * The file's format, by its magic number. Reads with pread, so the offset doesn't move.
+ */
+int decodeFormat(int fileDescriptor);
+
+const char* decodeFormatName(int format);
+
+/***
+ * Starts decoding the file, from the top, on up to numberOfThreads threads. With 0,
+ * there are none, and no chunks either - decodeRead decodes straight into its buffer,
+ * on the reader's thread, so a decoder's only its codec's state. The decoder owns the
+ * descriptor from here on. Returns NULL (and sets errno) if it couldn't - ENOTSUP for
+ * zstd without HAVE_ZSTD.
+ */
+Decoder* decodeStart(int fileDescriptor, int format, int numberOfThreads);
+
+/***
+ * The next length decoded bytes - all of them, unless the input ends first. Returns
+ * how many there were, 0 at the end, and -1 if the input couldn't be read or isn't
+ * valid.
+ */
+ssize_t decodeRead(Decoder* decoder, void* buffer, size_t length);
+
+/***
+ * Stops the threads, wherever they are, and closes the file.
+ */
+void decodeFinish(Decoder* decoder);
+
+/***
+ * Between reads of a decoder with no threads, closes its file - and lets go of its
+ * input buffer - keeping where it got to, so inputs over an open files limit don't
+ * each hold on to one. Returns close's result. Not for pipes, they can't be reopened.
+ */
+int decodeDetach(Decoder* decoder);
+
+/***
+ * Hands a detached decoder its file again, opened anew - it reads on from where it
+ * got to, wherever the descriptor's offset is.
+ */
+void decodeAttach(Decoder* decoder, int fileDescriptor);
+
+#endif
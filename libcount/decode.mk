@@ -0,0 +1,8 @@
+# What decode.c is compiled with, and what a tool that decodes links with - zstd only
+# if its headers are installed, gzip always.
+DECODE_CFLAGS :=
+DECODE_LIBS := -lz -pthread
+ifneq ($(shell printf '\043include <zstd.h>\n' | $(CC) -E - > /dev/null 2>&1 && echo yes),)
+DECODE_CFLAGS += -DHAVE_ZSTD
+DECODE_LIBS += -lzstd
+endif